@@ -0,0 +1,60 @@
+/*
+   Ereigniswarteschlange zwischen den Interrupts und der Loop.
+
+   Ringpuffer fester Größe (Zweierpotenz) mit genau einem Schreiber und einem Leser.
+   Geschrieben wird nur aus Interrupts. Die laufen auf dem AVR nicht verschachtelt,
+   zählen also zusammen als ein Schreiber. Gelesen wird nur in der Loop.
+   Der Schreiber ändert nur head, der Leser nur tail, beides sind einzelne Bytes.
+   Ein Eintrag wird erst komplett geschrieben bzw. gelesen und danach der Index
+   weitergesetzt, dadurch sind keine Interruptsperren nötig.
+*/
+#pragma once
+#include <stdint.h>
+
+// Ereignis: Art und ein Byte Daten
+struct Event {
+  uint8_t type;
+  uint8_t data;
+};
+
+template <uint8_t SIZE>
+class EventQueue {
+  static_assert((SIZE & (SIZE - 1)) == 0, "SIZE muss eine Zweierpotenz sein");
+
+ public:
+  // nur aus dem Interrupt, bei vollem Puffer wird das Ereignis verworfen und false geliefert
+  bool push(const Event& ev) {
+    uint8_t h = head;
+    uint8_t next = (h + 1) & (SIZE - 1);
+    if(next == tail) {
+      return false;
+    }
+    buf[h] = ev;
+    barrier();
+    head = next;
+    return true;
+  }
+
+  // nur aus der Loop
+  bool pop(Event& ev) {
+    uint8_t t = tail;
+    if(t == head) {
+      return false;
+    }
+    barrier();
+    ev = buf[t];
+    barrier();
+    tail = (t + 1) & (SIZE - 1);
+    return true;
+  }
+
+  bool empty() const { return head == tail; }
+
+ private:
+  // der Compiler darf Zugriffe auf buf nicht über die Indexzugriffe hinweg verschieben
+  static void barrier() { __asm__ __volatile__("" ::: "memory"); }
+
+  Event buf[SIZE];
+  volatile uint8_t head;
+  volatile uint8_t tail;
+};
@@ -0,0 +1,37 @@
+/*
+   Protothreads: Abläufe über mehrere Takte ohne delay() und ohne eigenen Stack.
+
+   Ein Thread ist eine normale Funktion mit einem Pt als Zustand, die einmal pro
+   Takt aufgerufen wird. PT_YIELD merkt sich die Stelle (Zeilennummer)
+   und kehrt zurück, beim nächsten Aufruf springt der switch in PT_BEGIN wieder dorthin.
+   Lokale Variablen überleben das nicht, was über einen Takt hinaus gebraucht wird,
+   muss static sein. Höchstens ein PT_ Makro pro Zeile und kein eigenes switch über
+   ein PT_YIELD hinweg.
+*/
+#pragma once
+#include <stdint.h>
+
+struct Pt {
+  uint16_t lc;  // Fortsetzungsstelle, 0 = Anfang
+};
+
+// Rückgabe eines Threads
+const uint8_t PT_WAITING = 0;
+const uint8_t PT_ENDED = 1;
+
+#define PT_BEGIN(pt) \
+  switch((pt)->lc) { \
+    case 0:
+
+#define PT_END(pt) \
+  } \
+  (pt)->lc = 0; \
+  return PT_ENDED;
+
+// bis zum nächsten Takt abgeben
+#define PT_YIELD(pt) \
+  do { \
+    (pt)->lc = __LINE__; \
+    return PT_WAITING; \
+    case __LINE__:; \
+  } while(0)
@@ -0,0 +1,318 @@
+/*
+   Zustandsautomat der Pumpe, Schutz gegen kurzes Takten, adaptive Nachlaufzeit,
+   Trockenlaufschutz und Sperre nach Unterspannung.
+
+   Ein Schritt pro Loop: aus den Eingängen wird über die Übergangstabelle der
+   neue Zustand bestimmt, daraus ergibt sich, ob die Pumpe laufen soll.
+   Die Logik hat keine Abhängigkeiten zur Hardware und lässt sich so auch auf
+   dem Host übersetzen und testen (test/test_pumpfsm*, pio test -e native).
+   test/test_sim steuert damit ein Modell von Vorfilter und Tank mit verschiedenen Regenprofilen.
+
+   Zustände
+   - IDLE:      Pumpe aus, warten auf vollen Vorfilter (und das Ende einer Startsperre)
+   - FILLING:   Vorfilter voll, Pumpe läuft, Nachlaufzähler wird immer wieder geladen
+   - RUN_ON:    Vorfilter wieder leer, Pumpe läuft bis der Nachlaufzähler abgelaufen ist
+   - TANK_FULL: Tank voll, Pumpe aus bis der Tank wieder Platz hat
+   - MANUAL:    Schalter auf manuell, Pumpe läuft solange der Taster gedrückt ist
+   - FAULT:     Fehler, Pumpe aus bis der Fehler weg ist
+*/
+#pragma once
+#include <stdint.h>
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#else
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t*)(addr))
+#endif
+
+enum PumpState : uint8_t { PS_IDLE, PS_FILLING, PS_RUN_ON, PS_TANK_FULL, PS_MANUAL, PS_FAULT, PS_COUNT };
+
+// Eingänge als Bits
+const uint8_t PI_AUTO = 0x01;     // Schalter auf Automatik
+const uint8_t PI_FILTER = 0x02;   // Vorfilter voll
+const uint8_t PI_TANK = 0x04;     // Tank voll
+const uint8_t PI_BUTTON = 0x08;   // Pumpentaster gedrückt
+const uint8_t PI_FAULT = 0x10;    // Fehler
+const uint8_t PI_EXPIRED = 0x20;  // Nachlaufzähler abgelaufen, wird im Schritt selbst gesetzt
+const uint8_t PI_HOLD = 0x40;     // Start gesperrt (Mindestpause, Starts pro Stunde)
+
+// Übergang: im Zustand from, wenn (Eingänge & mask) == value, dann nach to.
+// Die erste passende Zeile gewinnt, die Reihenfolge ist also die Priorität.
+struct PumpTransition {
+  uint8_t from;
+  uint8_t mask;
+  uint8_t value;
+  uint8_t to;
+};
+
+const PumpTransition PUMP_TRANSITIONS[] PROGMEM = {
+    {PS_IDLE, PI_AUTO, 0, PS_MANUAL},
+    {PS_IDLE, PI_FAULT, PI_FAULT, PS_FAULT},
+    {PS_IDLE, PI_TANK, PI_TANK, PS_TANK_FULL},
+    {PS_IDLE, PI_HOLD, PI_HOLD, PS_IDLE},
+    {PS_IDLE, PI_FILTER, PI_FILTER, PS_FILLING},
+    {PS_IDLE, PI_BUTTON, PI_BUTTON, PS_FILLING},
+
+    {PS_FILLING, PI_AUTO, 0, PS_MANUAL},
+    {PS_FILLING, PI_FAULT, PI_FAULT, PS_FAULT},
+    {PS_FILLING, PI_TANK, PI_TANK, PS_TANK_FULL},
+    {PS_FILLING, PI_FILTER | PI_BUTTON, 0, PS_RUN_ON},
+
+    {PS_RUN_ON, PI_AUTO, 0, PS_MANUAL},
+    {PS_RUN_ON, PI_FAULT, PI_FAULT, PS_FAULT},
+    {PS_RUN_ON, PI_TANK, PI_TANK, PS_TANK_FULL},
+    {PS_RUN_ON, PI_FILTER, PI_FILTER, PS_FILLING},
+    {PS_RUN_ON, PI_BUTTON, PI_BUTTON, PS_FILLING},
+    {PS_RUN_ON, PI_EXPIRED, PI_EXPIRED, PS_IDLE},
+
+    {PS_TANK_FULL, PI_AUTO, 0, PS_MANUAL},
+    {PS_TANK_FULL, PI_FAULT, PI_FAULT, PS_FAULT},
+    {PS_TANK_FULL, PI_TANK, 0, PS_IDLE},
+
+    {PS_MANUAL, PI_AUTO, PI_AUTO, PS_IDLE},
+
+    {PS_FAULT, PI_AUTO, 0, PS_MANUAL},
+    {PS_FAULT, PI_FAULT, 0, PS_IDLE},
+};
+const uint8_t PUMP_TRANSITION_COUNT = sizeof(PUMP_TRANSITIONS) / sizeof(PumpTransition);
+
+// Pumpe je Zustand: 0 = aus, 1 = an, 2 = folgt dem Taster
+const uint8_t PUMP_OUTPUT[PS_COUNT] PROGMEM = {0, 1, 1, 0, 2, 0};
+
+struct PumpFsm {
+  uint8_t state;
+  uint16_t counter;  // Nachlaufzähler in Loop Runden
+};
+
+// nächsten Zustand aus der Tabelle suchen, ohne passende Zeile bleibt der Zustand
+inline uint8_t pumpNextState(uint8_t state, uint8_t inputs) {
+  for(uint8_t i = 0; i < PUMP_TRANSITION_COUNT; i++) {
+    const PumpTransition* t = &PUMP_TRANSITIONS[i];
+    if((pgm_read_byte(&t->from) == state) && ((inputs & pgm_read_byte(&t->mask)) == pgm_read_byte(&t->value))) {
+      return pgm_read_byte(&t->to);
+    }
+  }
+  return state;
+}
+
+// ein Schritt des Automaten, liefert ob die Pumpe laufen soll
+inline bool pumpFsmStep(PumpFsm& fsm, uint8_t inputs, uint16_t runOnLaps) {
+  if(fsm.counter == 0) {
+    inputs |= PI_EXPIRED;
+  }
+  fsm.state = pumpNextState(fsm.state, inputs);
+  // Nachlaufzähler: im FILLING immer wieder laden, im RUN_ON herunterzählen
+  if(fsm.state == PS_FILLING) {
+    fsm.counter = runOnLaps;
+  } else if(fsm.state == PS_RUN_ON) {
+    if(fsm.counter > 0) {
+      fsm.counter--;
+    }
+  } else {
+    fsm.counter = 0;
+  }
+  uint8_t out = pgm_read_byte(&PUMP_OUTPUT[fsm.state]);
+  return (out == 2) ? (inputs & PI_BUTTON) != 0 : out != 0;
+}
+
+// Flanke Tank voll zwischen zwei Schritten: läuft die Pumpe im Automatikbetrieb, geht der Automat
+// sofort nach TANK_FULL. Liefert true, wenn das Relais jetzt abgeschaltet werden muss.
+// Der nächste Schritt geht erst über IDLE, ein Neustart unterliegt damit dem Startschutz (PI_HOLD).
+inline bool pumpFsmTankEdge(PumpFsm& fsm) {
+  if((fsm.state != PS_FILLING) && (fsm.state != PS_RUN_ON)) {
+    return false;
+  }
+  fsm.state = PS_TANK_FULL;
+  fsm.counter = 0;
+  return true;
+}
+
+// Schutz gegen kurzes Takten: nach dem Abschalten mindestens minOffLaps Runden Pause,
+// dazu höchstens maxStarts Starts in jeder Stunde. Gezählt wird in START_SLOTS Abschnitten
+// zu START_SLOT_TIME Sekunden (slotLaps Runden), ein Start ist nur erlaubt, solange in allen
+// Abschnitten zusammen (70 Minuten) weniger als maxStarts Starts liegen. Jedes beliebige Fenster
+// von einer Stunde liegt in höchstens START_SLOTS Abschnitten, mehr als maxStarts Starts pro
+// Stunde sind so nicht möglich.
+const uint8_t START_SLOTS = 7;
+const uint16_t START_SLOT_TIME = 600;
+
+struct StartGuard {
+  uint16_t offTicks;           // Runden seit dem Abschalten
+  uint16_t slotTicks;          // Runden im aktuellen Abschnitt
+  uint8_t count;               // Starts in allen Abschnitten
+  uint8_t slot;                // aktueller Abschnitt
+  uint8_t slots[START_SLOTS];  // Starts je Abschnitt
+};
+
+// einmal pro Runde vor dem Automaten: Abschnitte weiterschalten und Pausenzeit zählen.
+// Liefert true, wenn gerade kein neuer Start erlaubt ist (PI_HOLD).
+inline bool startGuardStep(StartGuard& g, bool relay, uint8_t maxStarts, uint16_t slotLaps, uint16_t minOffLaps) {
+  if(++g.slotTicks >= slotLaps) {
+    // der älteste Abschnitt fällt heraus und wird zum neuen
+    g.slotTicks = 0;
+    g.slot = (g.slot + 1 < START_SLOTS) ? g.slot + 1 : 0;
+    g.count -= g.slots[g.slot];
+    g.slots[g.slot] = 0;
+  }
+  if(!relay && g.offTicks < 0xFFFF) {
+    g.offTicks++;
+  }
+  return (g.offTicks < minOffLaps) || (g.count >= maxStarts);
+}
+
+// nach jedem Schaltvorgang des Relais: ein Start wird im aktuellen Abschnitt gezählt, ein Stopp startet die Pause
+inline void startGuardSwitch(StartGuard& g, bool on) {
+  if(on) {
+    if(g.count < 0xFF) {
+      g.slots[g.slot]++;
+      g.count++;
+    }
+  } else {
+    g.offTicks = 0;
+  }
+}
+
+// adaptive Nachlaufzeit: startet die Pumpe innerhalb von RUN_ON_SHORT_GAP Nachlaufzeiten wieder
+// oder war der Vorfilter länger als eine Nachlaufzeit voll, wird der Nachlauf um 1/4 länger.
+// Bei Pausen über RUN_ON_LONG_GAP Nachlaufzeiten wird er um 1/8 kürzer.
+// Grenzen sind die konfigurierte Nachlaufzeit und RUN_ON_MAX_FACT mal so viel.
+const uint8_t RUN_ON_MAX_FACT = 4;
+const uint8_t RUN_ON_SHORT_GAP = 2;
+const uint8_t RUN_ON_LONG_GAP = 8;
+
+struct RunOnAdapt {
+  uint16_t laps;       // angepasste Nachlaufzeit in Runden
+  uint16_t gapTicks;   // Runden in der aktuellen Pause, 0xFFFF = unbekannt
+  uint16_t fillTicks;  // Runden mit vollem Vorfilter beim Pumpen
+};
+
+// Nachlaufzeit um 1/4 verlängern, begrenzt auf RUN_ON_MAX_FACT * baseLaps
+inline void runOnGrow(RunOnAdapt& r, uint8_t baseLaps) {
+  uint16_t laps = r.laps + (r.laps >> 2) + 1;
+  uint16_t max = uint16_t(baseLaps) * RUN_ON_MAX_FACT;
+  r.laps = laps > max ? max : laps;
+}
+
+// nach jedem Schritt des Automaten mit altem und neuem Zustand.
+// Gemessen wird die Pause zwischen Ende des Nachlaufs und dem nächsten vollen Vorfilter
+// und wie lange der Vorfilter beim Pumpen voll bleibt.
+inline void runOnAdaptStep(RunOnAdapt& r, uint8_t prev, uint8_t state, uint8_t baseLaps) {
+  if(state == PS_FILLING) {
+    if(prev == PS_IDLE) {
+      // Pumpe startet nach einer Pause neu
+      if(r.gapTicks < uint32_t(r.laps) * RUN_ON_SHORT_GAP) {
+        runOnGrow(r, baseLaps);
+      } else if(r.gapTicks > uint32_t(r.laps) * RUN_ON_LONG_GAP) {
+        uint16_t laps = r.laps - (r.laps >> 3);
+        r.laps = laps < baseLaps ? baseLaps : laps;
+      }
+    }
+    if(prev != PS_FILLING) {
+      r.fillTicks = 0;
+    }
+    if(r.fillTicks < 0xFFFF) {
+      r.fillTicks++;
+    }
+  } else if(state == PS_RUN_ON) {
+    if(prev == PS_FILLING && r.fillTicks > r.laps) {
+      // Vorfilter war lange voll, viel Zulauf
+      runOnGrow(r, baseLaps);
+    }
+    r.gapTicks = 0;
+  } else if(state == PS_IDLE) {
+    if(r.gapTicks < 0xFFFF) {
+      r.gapTicks++;
+    }
+  } else {
+    // Tank voll, manuell oder Fehler: keine Aussage über den Zulauf möglich
+    r.gapTicks = 0xFFFF;
+  }
+}
+
+// Trockenlaufschutz: innerhalb von DRY_TIME Sekunden Pumpen muss der geglättete Rohwert
+// um DRY_RISE A/D Schritte steigen, sonst Fehler für DRY_BACKOFF Sekunden,
+// bei jedem weiteren Fehler doppelt so lange, höchstens 2^DRY_MAX_TRIPS mal.
+const uint8_t DRY_TIME = 60;
+const uint8_t DRY_RISE = 3;
+const uint8_t DRY_BACKOFF = 60;
+const uint8_t DRY_MAX_TRIPS = 5;
+
+struct DryRun {
+  uint16_t base;   // Bezugswert (geglätteter Rohwert, Festkomma 12.4)
+  uint16_t ticks;  // Runden seit dem letzten Anstieg
+  uint16_t wait;   // Wartezeit im Fehlerfall in Runden, solange > 0 gilt PI_FAULT
+  uint8_t trips;   // Anzahl der Fehler in Folge
+};
+
+// einmal pro Runde. watch: Pumpe läuft im Automatikbetrieb und der Sensor ist gültig.
+// Alles inkrementell: pro Runde ein Vergleich, kein Gradient per Division.
+inline void dryRunStep(DryRun& d, bool watch, uint16_t lvlEma, uint8_t lapsPerSec) {
+  if(d.wait > 0) {
+    d.wait--;
+    return;
+  }
+  if(!watch) {
+    d.base = lvlEma;
+    d.ticks = 0;
+    return;
+  }
+  if(lvlEma >= d.base + (DRY_RISE << 4)) {
+    // Pegel steigt, Wasser kommt an
+    d.base = lvlEma;
+    d.ticks = 0;
+    d.trips = 0;
+    return;
+  }
+  d.ticks++;
+  if(d.ticks >= uint16_t(DRY_TIME) * lapsPerSec) {
+    // kein Anstieg, Pumpe läuft trocken
+    uint32_t wait = (uint32_t(DRY_BACKOFF) * lapsPerSec) << d.trips;
+    d.wait = wait > 0xFFFF ? 0xFFFF : uint16_t(wait);
+    if(d.trips < DRY_MAX_TRIPS) {
+      d.trips++;
+    }
+    d.ticks = 0;
+  }
+}
+
+// Unterspannung: nach einer Abschaltung der laufenden Pumpe wegen kritischer Versorgungsspannung
+// bleibt die Pumpe SUPPLY_BACKOFF Sekunden gesperrt, bei jeder weiteren Abschaltung doppelt so lange,
+// höchstens 2^SUPPLY_MAX_TRIPS mal. Läuft die Pumpe SUPPLY_OK_TIME Sekunden ohne Einbruch,
+// beginnt die Zählung von vorn. So taktet das Relais nicht, wenn der Anlaufstrom die
+// Versorgung jedes Mal einbrechen lässt. Ein Einbruch bei stehender Pumpe zählt nicht, ein Start
+// wird dann schon über die Startschwelle verhindert (der Messwert kann da auch einige Sekunden alt sein).
+const uint8_t SUPPLY_BACKOFF = 30;
+const uint8_t SUPPLY_MAX_TRIPS = 5;
+const uint8_t SUPPLY_OK_TIME = 60;
+
+struct SupplyGuard {
+  uint16_t wait;     // Sperre in Runden, solange > 0 gilt PI_FAULT
+  uint16_t okTicks;  // Runden mit laufender Pumpe ohne Einbruch
+  uint8_t trips;     // Anzahl der Abschaltungen in Folge
+};
+
+// einmal pro Runde mit dem letzten Messwert und dem Relais vor dem Schritt,
+// liefert true solange die Pumpe gesperrt ist
+inline bool supplyGuardStep(SupplyGuard& g, bool crit, bool relay, uint8_t lapsPerSec) {
+  if(g.wait > 0) {
+    g.wait--;
+    return true;
+  }
+  if(crit && relay) {
+    uint32_t wait = (uint32_t(SUPPLY_BACKOFF) * lapsPerSec) << g.trips;
+    g.wait = wait > 0xFFFF ? 0xFFFF : uint16_t(wait);
+    if(g.trips < SUPPLY_MAX_TRIPS) {
+      g.trips++;
+    }
+    g.okTicks = 0;
+    return true;
+  }
+  if(relay && (g.trips > 0)) {
+    g.okTicks++;
+    if(g.okTicks >= uint16_t(SUPPLY_OK_TIME) * lapsPerSec) {
+      g.trips = 0;
+      g.okTicks = 0;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,113 @@
+# Flash/SRAM Report pro Symbol und Budget Prüfung nach dem Linken.
+#
+# Budgets in platformio.ini pro env:
+#   custom_size_margin = 64      ; Bytes Flash über dem Stand in size_baseline.csv
+#   custom_sram_budget = 384     ; Bytes SRAM (.data + .bss + .noinit + Heap), der Rest bleibt für den Stack
+#   custom_sram_heap = 26        ; Bytes Heap zur Laufzeit (malloc), steht nicht im ELF
+#   custom_size_top = 15         ; Anzahl der größten Symbole im Report
+# Ist ein Budget überschritten, schlägt der Build fehl.
+#
+# scripts/size_baseline.csv hält pro env die gemessenen Werte (env,flash,sram). Fehlt die env dort,
+# wird der Stand des Builds eingetragen, mit SIZE_BASELINE_UPDATE=1 werden alle Einträge neu
+# geschrieben. Die Datei wird mit eingecheckt, Änderungen daran sieht man im Review.
+import csv
+import os
+import subprocess
+
+Import("env")
+
+
+def section_sizes(elf):
+    out = subprocess.check_output([env.subst("$SIZETOOL"), "-A", elf]).decode()
+    sizes = {}
+    for line in out.splitlines():
+        parts = line.split()
+        if len(parts) >= 2 and parts[0].startswith(".") and parts[1].isdigit():
+            sizes[parts[0]] = int(parts[1])
+    return sizes
+
+
+def symbols(elf):
+    nm = env.subst("$OBJCOPY").replace("objcopy", "nm")
+    out = subprocess.check_output([nm, "-S", "-C", "-t", "d", "--size-sort", elf]).decode()
+    flash, ram = [], []
+    for line in out.splitlines():
+        parts = line.split(None, 3)
+        if len(parts) < 4:
+            continue
+        addr, size, kind, name = int(parts[0]), int(parts[1]), parts[2], parts[3]
+        # AVR ELF: SRAM liegt ab 0x800000, EEPROM ab 0x810000
+        if addr >= 0x810000:
+            continue
+        if addr >= 0x800000:
+            ram.append((size, kind, name))
+            if kind in "dD":
+                flash.append((size, kind, name))
+        else:
+            flash.append((size, kind, name))
+    return flash, ram
+
+
+def print_top(title, syms, count):
+    print("%s (größte %d Symbole)" % (title, count))
+    for size, kind, name in sorted(syms, reverse=True)[:count]:
+        print("  %6d  %s  %s" % (size, kind, name))
+
+
+def baseline_path():
+    return os.path.join(env.subst("$PROJECT_DIR"), "scripts", "size_baseline.csv")
+
+
+def read_baseline():
+    rows = {}
+    if os.path.exists(baseline_path()):
+        with open(baseline_path(), newline="") as f:
+            for row in csv.DictReader(f):
+                rows[row["env"]] = (int(row["flash"]), int(row["sram"]))
+    return rows
+
+
+def write_baseline(rows):
+    with open(baseline_path(), "w", newline="") as f:
+        out = csv.writer(f, lineterminator="\n")
+        out.writerow(["env", "flash", "sram"])
+        for name in sorted(rows):
+            out.writerow([name, rows[name][0], rows[name][1]])
+
+
+def size_budget(source, target, env):
+    elf = str(target[0])
+    top = int(env.GetProjectOption("custom_size_top", "15"))
+    margin = int(env.GetProjectOption("custom_size_margin", "0"))
+    sram_budget = int(env.GetProjectOption("custom_sram_budget", "0"))
+    sram_heap = int(env.GetProjectOption("custom_sram_heap", "0"))
+
+    sizes = section_sizes(elf)
+    flash_used = sizes.get(".text", 0) + sizes.get(".data", 0)
+    sram_used = sizes.get(".data", 0) + sizes.get(".bss", 0) + sizes.get(".noinit", 0) + sram_heap
+
+    name = env.subst("$PIOENV")
+    baseline = read_baseline()
+    if name not in baseline or os.environ.get("SIZE_BASELINE_UPDATE"):
+        baseline[name] = (flash_used, sram_used)
+        write_baseline(baseline)
+        print("size_baseline.csv: %s eingetragen" % name)
+    flash_budget = baseline[name][0] + margin
+
+    flash_syms, ram_syms = symbols(elf)
+    print_top("Flash", flash_syms, top)
+    print_top("SRAM", ram_syms, top)
+    print("Flash: %d / %d Bytes (Stand %d), SRAM: %d / %d Bytes (davon %d Heap, ohne Stack)" % (flash_used, flash_budget, baseline[name][0], sram_used, sram_budget, sram_heap))
+
+    failed = False
+    if flash_used > flash_budget:
+        print("Flash Budget um %d Bytes überschritten" % (flash_used - flash_budget))
+        failed = True
+    if sram_budget and sram_used > sram_budget:
+        print("SRAM Budget um %d Bytes überschritten" % (sram_used - sram_budget))
+        failed = True
+    if failed:
+        env.Exit(1)
+
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", size_budget)
@@ -34,13 +34,136 @@
      LED4-8:  5 stufige Anzeige des Füllgrades grün, LED 8: Sensorfehler -> Rot
    - Bug in Mittelwertbildung behoben.
    - Tank voll, sofort Pumpende 
+
+   16.10.2026
+   - Warmstart: Mittelwertpuffer, Pumpennachlauf und Zähler überleben den
+     geplanten Watchdog Reset (.noinit Bereich mit Magic und CRC)
+   - Konfiguration (Zeiten, Level, Helligkeit) im EEPROM, versioniert und mit CRC,
+     Standardwerte als Fallback
+   - Kalibrierung des Drucksensors am Gerät (Pumpentaster beim Einschalten gedrückt halten),
+     Umrechnung in Prozent über einen Festkomma Faktor statt map()
+   - Überwachung der Versorgungsspannung über die interne Referenz, bei Unterspannung
+     startet die Pumpe nicht. Pumpenrelais wird direkt nach dem Reset sicher abgeschaltet.
+     Schwellen in der Konfiguration, die Referenz wird bei der Kalibrierung gegen die 5V
+     Versorgung ausgemessen (auch ohne Drucksensor: Pumpentaster beim Einschalten gedrückt
+     halten), bis dahin gilt ihr oberer Grenzwert. Bricht die Spannung bei laufender Pumpe
+     ein, bleibt die Pumpe mit sich verdoppelnder Wartezeit gesperrt.
+   - Brown-out Detection auf 2,7V, EEPROM bleibt beim Flashen erhalten (hfuse 0xD5)
+   - optionale Telemetrie (#define telemetry): eine CSV Zeile pro Loop mit
+     raw,lvl,in,pump,us,skip,ro,starts,rst,drop über einen Software UART (nur TX, 9600 8N1) auf dem
+     LED_PUMP Pin (= MISO am ISP Stecker). Gesendet wird per Timer1 Interrupt aus
+     einem Ringpuffer, die Loop wartet nie. Die Zeilen lassen sich direkt mit
+     einem seriellen Plotter (z.B. Arduino IDE) darstellen.
+   - Pumpensteuerung als tabellengesteuerter Zustandsautomat (pumpfsm.h),
+     ein Schritt und höchstens ein Schaltvorgang des Relais pro Loop
+   - Ausgänge über Schattenregister, die Ports werden einmal pro Loop und nur bei
+     Änderung geschrieben. Die Anzahl der eingesparten Schreibzugriffe steht in der Telemetrie.
+   - Trockenlaufschutz: steigt der Tankpegel während des Pumpens nicht, geht die Pumpe
+     in den Fehlerzustand, mit sich verdoppelnder Wartezeit bis zum nächsten Versuch
+   - adaptive Nachlaufzeit: füllt sich der Vorfilter nach dem Nachlauf schnell wieder,
+     wird der Nachlauf verlängert (weniger Schaltspiele des Relais), bei langen Pausen
+     geht er wieder auf den konfigurierten Wert zurück
+   - Schutz gegen kurzes Takten: Mindestpause der Pumpe und maximale Starts pro Stunde
+     (gleitend über Abschnitte von 10 Minuten), beides in der Konfiguration. Automat und
+     Startschutz lassen sich auf dem Host testen (pio test -e native, test/test_pumpfsm*).
+   - Simulation von Vorfilter und Tank mit Regenprofilen auf dem Host (test/test_sim): steuert
+     das Modell mit Automat, Startschutz, adaptiver Nachlaufzeit und Trockenlaufschutz aus
+     pumpfsm.h, Drucksensor mit Rauschen, bis zu einer ganzen Saison in Sekunden. Meldet
+     Überläufe, Schaltspiele des Relais und die Energie der Pumpe.
+   - Pumpenstopp über den analogen Pegel mit Hysterese (Konfiguration), der
+     Schwimmerschalter Tank voll bleibt als Rückfallebene
+   - Benchmark (#define benchmark bzw. env:attiny84_bench): Zyklen pro Funktion über
+     Timer1, Ausgabe als Tabelle über die Telemetrie, Überschreitung des Budgets wird als FAIL markiert.
+     Jeder Abschnitt zählt nur seine eigene Zeit (ohne verschachtelte Messungen), dazu der Rest
+     der Loop, die Zeilen ergeben zusammen die Loop Zeit.
+     Die Budgets sind noch geschätzt (Spalte budget_est, Ergebnis OK? / FAIL?).
+     Timer1 läuft dafür frei durch, der Software UART arbeitet mit mitlaufendem Compare Register.
+   - Laufzeitstatistik (#define instrument bzw. env:attiny84_instrument): min/max/Mittel der Loop Zeit, Histogramm,
+     größte Interrupt Latenz und längste Sperre durch strip.show(), alle 5s über die Telemetrie
+   - Flash/SRAM Report und Budget beim Build (scripts/size_budget.py): Flash gegen den eingecheckten
+     Stand pro env (scripts/size_baseline.csv), SRAM fest. Freier Stack über Stack Painting in der
+     Laufzeitstatistik. Telemetriepuffer in allen Builds 64 Bytes, die Statistik kommt dafür in zwei Zeilen.
+   - Build Varianten über eine constexpr Konfiguration (Anzeige, Zeitprofil, Filter, Sensor)
+     statt #ifdef ledstripe / #ifdef debug, Auswahl über die envs in platformio.ini
+   - Loop ereignisgesteuert: Takt (Timer0 Compare) und Flanken der Eingänge (Pin Change)
+     kommen über eine lock-freie Warteschlange (eventqueue.h), dazwischen schläft die CPU.
+     Tank voll schaltet die Pumpe direkt bei der Flanke ab.
+   - mehrbytige Werte zwischen Interrupt und Loop ohne Interruptsperre (snapshot.h):
+     Sequenzzähler für Werte aus dem Interrupt (Latenz), Doppelpuffer für Werte
+     aus der Loop (Taktperiode)
+   - Abläufe über mehrere Takte als Protothreads (pt.h) statt blockierender Schleifen
+     mit delay(): Blinken vor dem Autoreset und die Kalibrierung laufen im Takt mit,
+     Watchdog und Flankenabschaltung bleiben dabei aktiv
+   - Systemtakt im Leerlauf auf 1 MHz (CLKPR), Timer0 läuft mit angepasstem Vorteiler
+     gleich schnell weiter, millis() bleibt richtig. Gearbeitet wird immer mit 8 MHz.
+   - Timer1, USI und ADC über das Power Reduction Register nur an, solange sie jemand
+     braucht (Referenzzähler), der Analogkomparator ist ganz aus. Mit instrument kommt
+     eine pwr Zeile mit Einschaltanteil und geschätzter Ersparnis.
+   - Pegel und Versorgungsspannung adaptiv abgetastet: beim Pumpen, vollem Vorfilter
+     oder sich änderndem Pegel jeden Takt, bei ruhigem Pegel immer seltener (bis 3,2s).
+     Das Filterfenster ist bei seltener Abtastung kürzer.
+   - Tiefschlaf (Power-down) nach einstellbarer Ruhezeit (Konfiguration, Minuten) mit
+     dunkler Anzeige. Wecken über Pin Change (Vorfilter, Taster, Auto/Man, Tank voll) und
+     alle 8s über den Watchdog Interrupt für Pegelmessung und Autoreset.
+   - LED Balken geht nach einstellbarer Zeit ohne Änderung aus (Konfiguration, Sekunden),
+     Taster oder jede Änderung der Anzeige schaltet ihn wieder ein. Ohne Änderung wird er
+     nur noch einmal pro Sekunde aufgefrischt. Optional ein Pin, der die Versorgung des
+     Balkens über einen Transistor schaltet (LED_STRIP_PWR).
+   - Anzeige LEDs per PWM gedimmt (LED_DUTY): LED_AUTO über OC0B, LED_TANK_FULL und
+     LED_PUMP über OC1A/OC1B (Timer1 nur an, solange eine davon leuchtet), LED_FILTER_FULL
+     per Software PWM im Timer0 Interrupt. Mit Telemetrie gehört Timer1 dem UART,
+     LED_TANK_FULL läuft dann ebenfalls per Software PWM.
 */
 #include <Adafruit_NeoPixel.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <avr/power.h>
+#include <avr/sleep.h>
 #include <avr/wdt.h>
+#include <util/crc16.h>
 
 #include "Arduino.h"
-#define ledstripe
-// #define debug
+#include "eventqueue.h"
+#include "pt.h"
+#include "snapshot.h"
+#include "pumpfsm.h"
+// #define telemetry
+// #define benchmark
+// #define instrument
+
+// Benchmark und Laufzeitstatistik geben ihre Werte über die Telemetrie aus
+// und brauchen den Zyklenzähler auf Timer1
+#if defined(benchmark) || defined(instrument)
+#define telemetry
+#define cyclecounter
+#endif
+
+// Build Variante: Anzeige, Zeitprofil, Filter und Sensor werden zur Compilezeit gewählt.
+// Alle Abfragen darauf sind Konstanten, der nicht benutzte Code fällt beim Übersetzen weg.
+enum class Display : byte { Strip, Heartbeat };  // LED Balken oder nur Blinken am Balken Pin
+enum class Timing : byte { Field, Debug };       // Feld: normale Zeiten, Debug: verkürzt
+enum class Filter : byte { TrimmedMean, None };  // Mittelwert ohne Min/Max oder ungefiltert
+enum class Sensor : byte { Current420, None };   // Drucksensor 4-20mA oder nur Schwimmerschalter
+struct BuildConfig {
+  Display display;
+  Timing timing;
+  Filter filter;
+  Sensor sensor;
+};
+
+// Auswahl über build_flags in platformio.ini
+#if defined(VARIANT_HEARTBEAT)
+constexpr BuildConfig BUILD = {Display::Heartbeat, Timing::Field, Filter::TrimmedMean, Sensor::Current420};
+#elif defined(VARIANT_FLOAT)
+constexpr BuildConfig BUILD = {Display::Strip, Timing::Field, Filter::None, Sensor::None};
+#elif defined(VARIANT_DEBUG)
+constexpr BuildConfig BUILD = {Display::Strip, Timing::Debug, Filter::TrimmedMean, Sensor::Current420};
+#else
+constexpr BuildConfig BUILD = {Display::Strip, Timing::Field, Filter::TrimmedMean, Sensor::Current420};
+#endif
+constexpr bool HAS_STRIP = BUILD.display == Display::Strip;
+constexpr bool HAS_SENSOR = BUILD.sensor == Sensor::Current420;
+constexpr bool IS_DEBUG = BUILD.timing == Timing::Debug;
 
 // Hardware Arduino Uno -> Zielplattform TinyTPS mit D1 Relais
 // Din  0 1 2 3
@@ -61,61 +184,379 @@ const byte SEN_FILTER_FULL = 1;  // Sensor Vorfilter voll
 const byte SWT_AUTO_MAN = 2;     // Schalter manueller Betrieb: low = man / high = auto
 const byte SEN_TANK_FLOAT = A3;  // Sensor Tank analoges Signal zur Tankfüllung
 const byte SWT_PUMP_MAN = 10;    // Taster manueller Pumpen Betrieb: active = low
+// optional: Versorgung des LED Balkens über einen Transistor, high = an. Auf der
+// Platine ist kein Pin mehr frei, NO_PIN = Balken hängt fest an der Versorgung.
+const byte NO_PIN = 0xFF;
+const byte LED_STRIP_PWR = NO_PIN;
+
+// Port Pins der Ausgänge im tinyX4_reverse Layout, für den frühen Start und die Schattenregister
+#define OUT_PUMP_PORT PORTA
+#define OUT_PUMP_DDR DDRA
+#define OUT_PUMP_BIT PA4
+#define LED_PUMP_BIT PA5
+#define LED_TANK_FULL_BIT PA6
+#define LED_AUTO_BIT PA7
+#define LED_FILTER_FULL_BIT PB1
+#define LED_STRIP_BIT PB2
+// Eingänge mit Pin Change Interrupt: Tank voll, Vorfilter voll, Auto/Man an PA0-PA2, Pumpentaster an PB0
+#define SEN_TANK_FULL_BIT PA0
+const byte IN_MASK_A = _BV(PA0) | _BV(PA1) | _BV(PA2);
+const byte IN_MASK_B = _BV(PB0);
+// von den Schattenregistern verwaltete Bits, mit Telemetrie gehört LED_PUMP dem UART
+#ifdef telemetry
+const byte OUT_MASK_A = _BV(OUT_PUMP_BIT) | _BV(LED_TANK_FULL_BIT) | _BV(LED_AUTO_BIT);
+#else
+const byte OUT_MASK_A = _BV(OUT_PUMP_BIT) | _BV(LED_PUMP_BIT) | _BV(LED_TANK_FULL_BIT) | _BV(LED_AUTO_BIT);
+#endif
+const byte OUT_MASK_B = _BV(LED_FILTER_FULL_BIT) | (HAS_STRIP ? 0 : _BV(LED_STRIP_BIT));
+
+// Anzeige LEDs gedimmt, Einschaltanteil LED_DUTY / 256. Hardware PWM: Compare Ausgang ist verbunden,
+// solange die LED an ist. Software PWM: im Timer0 Interrupt an (TCNT0 = 0) und aus (TCNT0 = LED_DUTY).
+// Aus heißt in beiden Fällen Port Bit low. Die übrigen Bits schreibt flushOutputs() direkt.
+const byte LED_DUTY = 48;
+#ifdef telemetry
+const byte PWM_HW_A = _BV(LED_AUTO_BIT);
+const byte PWM_SW_A = _BV(LED_TANK_FULL_BIT);
+#else
+const byte PWM_HW_A = _BV(LED_AUTO_BIT) | _BV(LED_TANK_FULL_BIT) | _BV(LED_PUMP_BIT);
+const byte PWM_SW_A = 0;
+#endif
+const byte PWM_T1_A = _BV(LED_TANK_FULL_BIT) | _BV(LED_PUMP_BIT);
+const byte PWM_SW_B = _BV(LED_FILTER_FULL_BIT);
+const byte PORT_MASK_A = OUT_MASK_A & ~(PWM_HW_A | PWM_SW_A);
+const byte PORT_MASK_B = OUT_MASK_B & ~PWM_SW_B;
+
+// A/D Wert der internen Referenz (Bandgap, bg in mV) gemessen gegen Vcc: ADC = bg * 1024 / Vcc,
+// je kleiner Vcc, desto größer der Wert. Die Referenz streut zwischen Exemplaren (1,0-1,2V),
+// sie wird bei der Kalibrierung gegen die bekannte Versorgung VCC_CAL ausgemessen.
+#define VCC_RAW(bg, mv) word(uint32_t(bg) * 1024UL / (mv))
+const word VCC_CAL = 5000;
+const word BANDGAP_MIN = 1000;
+const word BANDGAP_MAX = 1200;
+const byte VCC_CAL_SAMPLES = 16;
+
+// Systemtakt während die CPU auf ein Ereignis wartet: 8 MHz / 8 = 1 MHz.
+// Timer0 (millis(), micros(), Takt) läuft dann mit Vorteiler 8 statt 64, also gleich schnell.
+// Pro Wechsel geht höchstens ein Timer0 Schritt (8µs) verloren bzw. kommt dazu.
+// Software UART und Zyklenzähler auf Timer1 vertragen keinen Taktwechsel, mit Telemetrie bleibt es bei 8 MHz.
+#ifdef telemetry
+constexpr bool CLOCK_SCALING = false;
+#else
+constexpr bool CLOCK_SCALING = true;
+#endif
+const byte T0_CS_RUN = _BV(CS01) | _BV(CS00);
+const byte T0_CS_IDLE = _BV(CS01);
+const byte T0_CS_MASK = _BV(CS02) | _BV(CS01) | _BV(CS00);
+
+// Tiefschlaf: Timer1 steht im Power-down, mit Telemetrie gibt es daher keinen Tiefschlaf.
+// Der Watchdog weckt alle DEEP_SLEEP_WAKE Sekunden (8s, Watchdog Oszillator ±10%).
+#ifdef telemetry
+constexpr bool DEEP_SLEEP = false;
+#else
+constexpr bool DEEP_SLEEP = true;
+#endif
+const byte DEEP_SLEEP_WAKE = 8;
+const byte WDT_8S_BITS = _BV(WDP3) | _BV(WDP0);
+
+// über PRR schaltbare Module, Timer0 (millis()) bleibt immer an
+enum Periph : byte { P_ADC, P_USI, P_TIMER1, P_COUNT };
+const byte PERIPH_PRR[P_COUNT] = {_BV(PRADC), _BV(PRUSI), _BV(PRTIM1)};
+#ifdef instrument
+// Richtwerte für den Strom je Modul in µA bei 5V und 8 MHz, Größenordnung nach Datenblatt,
+// nicht nachgemessen. Im Leerlauf mit 1 MHz ist es entsprechend weniger.
+const word PERIPH_UA[P_COUNT] = {250, 60, 140};
+#endif
+
+#ifdef telemetry
+// Software UART, nur senden. Ein Bit pro Timer1 Compare Interrupt, Timer1 läuft frei mit Prescaler 1,
+// das Compare Register wird pro Bit um TEL_BIT_TIME weitergeschoben.
+const long TEL_BAUD = 9600;
+const word TEL_BIT_TIME = F_CPU / TEL_BAUD;
+// Ringpuffer, Größe muss eine Zweierpotenz sein. Jede Zeile muss hineinpassen (höchstens 63 Zeichen),
+// die Statistik ist deshalb auf mehrere Zeilen verteilt.
+const byte TEL_BUF_SIZE = 64;
+const byte TEL_BUF_MASK = TEL_BUF_SIZE - 1;
+#endif
+
+#ifdef benchmark
+// gemessene Abschnitte, Reihenfolge wie BENCH_NAMES und BENCH_BUDGET. Die Abschnitte überlappen nicht:
+// jeder zählt nur seine eigene Zeit ohne die darin verschachtelten Messungen (getAverage() läuft in
+// readAllInputs()), B_REST ist der Rest von doTick(). Die Summe aller Zeilen ist die Loop Zeit.
+enum BenchId : byte { B_REST, B_INPUTS, B_AVERAGE, B_PUMP, B_STRIP, B_COUNT };
+// Budget je Abschnitt in CPU Zyklen (8 MHz). Die Werte sind aus dem Code abgeschätzt, noch nicht
+// auf der Hardware gemessen. Solange BENCH_MEASURED false ist, heißt die Spalte budget_est und
+// das Ergebnis ist nur ein Hinweis (OK? / FAIL?). Nach der ersten Messung Werte eintragen und umstellen.
+const word BENCH_BUDGET[B_COUNT] PROGMEM = {6500, 7400, 600, 1500, 8000};
+constexpr bool BENCH_MEASURED = false;
+// Zyklen der inneren Messungen im gerade laufenden Abschnitt. Deren Eigenbedarf (benchAdd())
+// bleibt beim äußeren Abschnitt.
+uint32_t benchInner;
+#define BENCH(id, stmt)                 \
+  do {                                  \
+    uint32_t _outer = benchInner;       \
+    benchInner = 0;                     \
+    uint32_t _start = cycles();         \
+    stmt;                               \
+    uint32_t _time = cycles() - _start; \
+    benchAdd(id, _time - benchInner);   \
+    benchInner = _outer + _time;        \
+  } while(0)
+#else
+#define BENCH(id, stmt) stmt
+#endif
+
+#ifdef instrument
+// Statistik alle STAT_LAPS Runden ausgeben, Histogramm der Loop Zeit in Zweierpotenzen ab 0,5ms
+const byte STAT_LAPS = 50;
+const byte STAT_BUCKETS = 8;
+// Muster für das Stack Painting
+const byte STACK_CANARY = 0xC5;
+#endif
+
+// Ereignisse der Loop, EV_EDGE trägt den Zustand der Eingänge (PA0-PA2, PB0 als Bit 3).
+// Offen sind höchstens ein Takt und eine Flanke (edgePending), 3 Plätze reichen.
+enum EventType : byte { EV_TICK, EV_EDGE };
+const byte EVENT_QUEUE_SIZE = 4;
 
 // Anzahl der LEDs im Balken
 const byte LED_STRIP_COUNT = 8;
 
+// Standardwerte der Konfiguration. Die eigentlichen Werte stehen im EEPROM
+// und werden in setup() einmalig in die RAM Struktur cfg geladen.
 // Mindestverzögerung einer Loop in msec
 // Die eigentliche Verarbeitung im Programm wird bei dieser Zeit nicht berücksichtigt
 #define LOOP_TIME 100
-const word ERR_LVL = 100;
-const word MIN_LVL = 220;  // Wert von 4mA für den 0-Punkt
-const word MAX_LVL = 942;  // 1024 / 5 * 4,6 = 942   1024 = 10 Bit A/D Auflösung = 5V (Referenzspannung) 4.6V gemessen bei max. Pegel
+#define ERR_LVL 100
+#define MIN_LVL 220  // Wert von 4mA für den 0-Punkt
+#define MAX_LVL 942  // 1024 / 5 * 4,6 = 942   1024 = 10 Bit A/D Auflösung = 5V (Referenzspannung) 4.6V gemessen bei max. Pegel
 
-// Korrekturfaktor Anzahl der Runden pro Sekunde
-const long LOOP_COR_FACT = 1000 / LOOP_TIME;
 // Nachlaufzeit der Pumpe in Sekunden
-#ifdef debug
-#define RUN_ON_TIME 3
-#else
-#define RUN_ON_TIME 15
-#endif
+constexpr byte RUN_ON_TIME = IS_DEBUG ? 3 : 15;
 
 // Helligkeit der Balkenanzeige
 #define BRIGHTNESS 10
 
-// calculating constants
+// Autoreset in Minuten, nach dieser Zeit wird
+// der Watchdog nicht mehr getriggert und das System rebooted automatisch
+constexpr word MAX_AUTO_RESTART = IS_DEBUG ? 1 : 60;
+
+// Mindestpause der Pumpe in Sekunden und maximale Anzahl Starts pro Stunde
+#define MIN_OFF_TIME 10
+#define MAX_STARTS 30
+
+// Pumpenstopp über den analogen Pegel: ab STOP_LVL % wird nicht mehr gepumpt,
+// erst wieder unter STOP_LVL - STOP_HYST %. STOP_LVL 0 schaltet die Funktion ab.
+#define STOP_LVL 95
+#define STOP_HYST 5
+
+// Ruhezeit in Minuten bis zum Tiefschlaf, 0 schaltet ihn ab
+constexpr byte SLEEP_AFTER = IS_DEBUG ? 1 : 10;
+
+// LED Balken aus nach so vielen Sekunden ohne Änderung der Anzeige, 0 = immer an
+#define BLANK_AFTER 60
+
+// Versorgungsspannung in mV: unterhalb VCC_START startet die Pumpe nicht,
+// unterhalb VCC_MIN wird eine laufende Pumpe abgeschaltet (mit Sperre, siehe SupplyGuard).
+// BANDGAP gilt bis zur ersten Kalibrierung, angenommen wird der obere Grenzwert der Referenz:
+// mit dem Nennwert (1100) würde ein Exemplar mit 1,2V schon bei 5V als Unterspannung gelten und
+// nie pumpen. So wird nie zu Unrecht gesperrt, bei einer kleinen Referenz greifen die Schwellen
+// unkalibriert aber erst tiefer (bei 1,0V etwa 3,8V bzw. 3,6V).
+#define VCC_START 4600
+#define VCC_MIN 4300
+#define BANDGAP 1200
+
+// Konfigurationsblock, Layout wie im EEPROM. Bei Änderungen CFG_VERSION erhöhen.
+const byte CFG_VERSION = 6;
+struct Config {
+  byte version;
+  byte loopTime;     // Mindestzeit einer Loop in msec
+  byte runOnTime;    // Nachlaufzeit der Pumpe in Sekunden
+  byte brightness;   // Helligkeit der Balkenanzeige
+  word errLvl;       // darunter Sensorfehler
+  word minLvl;       // A/D Wert bei leerem Tank (4mA)
+  word maxLvl;       // A/D Wert bei vollem Tank
+  word autoRestart;  // Zeit bis zum Autoreset in Minuten
+  byte minOffTime;   // Mindestpause der Pumpe in Sekunden
+  byte maxStarts;    // maximale Pumpenstarts pro Stunde
+  byte stopLvl;      // Pumpenstopp ab diesem Pegel in %, 0 = aus
+  byte stopHyst;     // Hysterese des Pumpenstopps in %
+  byte sleepAfter;   // Ruhezeit bis zum Tiefschlaf in Minuten, 0 = aus
+  byte blankAfter;   // LED Balken aus nach Sekunden ohne Änderung, 0 = aus
+  word vccStart;     // darunter kein Pumpenstart, in mV
+  word vccMin;       // darunter Abschaltung der Pumpe, in mV
+  word bandgap;      // gemessene interne Referenz in mV
+  byte crc;
+};
+
+// CRC8 (Polynom 0x07) wie _crc8_ccitt_update(), hier zur Compilezeit für das EEPROM Abbild
+constexpr byte crc8Bits(byte crc, byte n) { return n == 0 ? crc : crc8Bits((crc & 0x80) ? byte((crc << 1) ^ 0x07) : byte(crc << 1), n - 1); }
+constexpr byte crc8(byte crc, byte data) { return crc8Bits(byte(crc ^ data), 8); }
+constexpr byte crc8w(byte crc, word data) { return crc8(crc8(crc, byte(data)), byte(data >> 8)); }
+constexpr byte crcField(byte crc, byte value) { return crc8(crc, value); }
+constexpr byte crcField(byte crc, word value) { return crc8w(crc, value); }
+constexpr byte crcFields(byte crc) { return crc; }
+template <typename T, typename... R>
+constexpr byte crcFields(byte crc, T value, R... rest) {
+  return crcFields(crcField(crc, value), rest...);
+}
+constexpr byte CFG_DEFAULT_CRC = crcFields(0, CFG_VERSION, byte(LOOP_TIME), byte(RUN_ON_TIME), byte(BRIGHTNESS), word(ERR_LVL), word(MIN_LVL), word(MAX_LVL),
+                                           word(MAX_AUTO_RESTART), byte(MIN_OFF_TIME), byte(MAX_STARTS), byte(STOP_LVL), byte(STOP_HYST), byte(SLEEP_AFTER),
+                                           byte(BLANK_AFTER), word(VCC_START), word(VCC_MIN), word(BANDGAP));
+
+// Standardwerte, landen auch in der .eep Datei (pio run -t uploadeeprom)
+#define CFG_DEFAULT_INIT {CFG_VERSION, LOOP_TIME, RUN_ON_TIME, BRIGHTNESS, ERR_LVL, MIN_LVL, MAX_LVL, MAX_AUTO_RESTART, MIN_OFF_TIME, MAX_STARTS, STOP_LVL, STOP_HYST, SLEEP_AFTER, BLANK_AFTER, VCC_START, VCC_MIN, BANDGAP, CFG_DEFAULT_CRC}
+const Config CFG_DEFAULT PROGMEM = CFG_DEFAULT_INIT;
+Config EEMEM eeCfg = CFG_DEFAULT_INIT;
+Config cfg;
+
+// calculating constants, werden in loadConfig() aus cfg berechnet
+// Korrekturfaktor Anzahl der Runden pro Sekunde
+byte loopCorFact;
 // Nachlaufzeit der Pumpe in loop Zyklen
-const byte PUMP_LAP_COUNT = RUN_ON_TIME * LOOP_COR_FACT;
+byte pumpLapCount;
+// Mindestpause der Pumpe in loop Zyklen
+word minOffLaps;
+// Länge eines Abschnitts der Startzählung in loop Zyklen
+word startSlotLaps;
+// Ruhezeit bis zum Tiefschlaf in loop Zyklen, höchstens 0xFFFF
+word sleepLaps;
+// Zeit ohne Änderung bis der LED Balken ausgeht in loop Zyklen
+word blankLaps;
+// Schwellen der Versorgungsspannung als A/D Wert der Referenz
+word vccStartRaw;
+word vccMinRaw;
+// Festkomma Faktor (16.16) für die Umrechnung A/D Wert -> Prozent, 100% = maxLvl - minLvl
+uint32_t lvlScale;
 
-// Autoreset, nach dieser Anzahl der Runden wird
-// der Watchdog nicht mehr getriggert und das System rebooted automatisch
-#ifdef debug
-const long MAX_AUTO_RESTART = 60 * LOOP_COR_FACT;
-#else
-const long MAX_AUTO_RESTART = 60L * 60L * LOOP_COR_FACT;
-#endif
+// Kalibrierung: Anzahl der gemittelten Messungen und Abbruch nach dieser Zeit ohne Eingabe in Sekunden
+const byte CAL_SAMPLES = 64;
+const byte CAL_TIMEOUT = 120;
+// Protothreads für Autoreset und Kalibrierung, die Kalibrierung läuft nur wenn calibrating gesetzt ist
+Pt ptRestart;
+Pt ptCal;
+bool calibrating;
 
-// Anzahl der gespeicherten Levelwerte
+// Anzahl der gespeicherten Levelwerte, bei seltener Abtastung wird nur über die letzten SPARSE_LVLS gemittelt
 const byte MAX_LVLS = 7;
+const byte SPARSE_LVLS = 3;
 byte lvls[MAX_LVLS];
 byte pos;
 
-#ifdef ledstripe
-Adafruit_NeoPixel strip = Adafruit_NeoPixel(LED_STRIP_COUNT, LED_STRIP_PIN, NEO_GRB + NEO_KHZ800);
-uint32_t LED_BLACK = strip.Color(0, 0, 0);
-uint32_t LED_GREEN = strip.Color(0, 255, 0);
-uint32_t LED_RED = strip.Color(255, 0, 0);
-uint32_t LED_BLUE = strip.Color(0, 0, 255);
-#endif
+// adaptive Abtastung von Pegel und Versorgungsspannung: Abstand in Takten, beim Pumpen, vollem Vorfilter
+// und gedrücktem Taster 1. Ändert sich der Rohwert SAMPLE_STABLE Messungen lang nicht um mehr als
+// SAMPLE_DELTA, verdoppelt sich der Abstand bis SAMPLE_MAX_GAP, jede Änderung setzt ihn zurück.
+const byte SAMPLE_MAX_GAP = 32;
+const byte SAMPLE_STABLE = 8;
+const byte SAMPLE_DELTA = 4;
 
-void doAutoPump();
-void doManualPump();
+// Zustand, der über den geplanten Watchdog Reset gerettet wird.
+// Liegt in .noinit, wird also vom Startup Code nicht genullt.
+const word WARM_MAGIC = 0x5A17;
+struct WarmState {
+  word magic;
+  byte lvls[MAX_LVLS];
+  byte pos;
+  PumpFsm pumpFsm;
+  word runOnLaps;
+  byte startCount;  // Starts der letzten Stunde (StartGuard)
+  word dryWait;   // laufende Trockenlaufsperre in Runden
+  byte dryTrips;  // Trockenlauffehler in Folge
+  word restarts;  // Anzahl der Warmstarts seit dem letzten Kaltstart
+  byte crc;
+};
+WarmState warm __attribute__((section(".noinit")));
+
+// Farben wie Adafruit_NeoPixel::Color(r, g, b)
+const uint32_t LED_BLACK = 0x000000;
+const uint32_t LED_GREEN = 0x00FF00;
+const uint32_t LED_RED = 0xFF0000;
+const uint32_t LED_BLUE = 0x0000FF;
+const uint32_t LED_GREY = 0x202020;
+
+// Anzeige Backends. Der LED Balken ist ein Template, damit das NeoPixel Objekt
+// nur dann angelegt wird, wenn die Variante es auch benutzt.
+// Mit PWR schaltet sleep() die Versorgung ab. Vorher geht die Datenleitung auf low, sonst
+// würden die LEDs über den Dateneingang versorgt. Nach wake() brauchen die LEDs einen Moment,
+// bis sie Daten annehmen, wake() liefert dann false und gezeigt wird erst im nächsten Takt.
+template <byte COUNT, byte PIN, byte PWR = NO_PIN>
+struct StripBar {
+  static const bool ENABLED = true;
+  static Adafruit_NeoPixel strip;
+  static void begin(byte brightness) {
+    if(PWR != NO_PIN) {
+      pinMode(PWR, OUTPUT);
+      digitalWrite(PWR, HIGH);
+    }
+    strip.begin();
+    strip.setBrightness(brightness);
+    strip.show();
+  }
+  static void clear() {
+    strip.clear();
+    strip.show();
+  }
+  static void sleep() {
+    clear();
+    if(PWR != NO_PIN) {
+      digitalWrite(PIN, LOW);
+      digitalWrite(PWR, LOW);
+    }
+  }
+  static bool wake() {
+    if(PWR == NO_PIN) {
+      return true;
+    }
+    digitalWrite(PWR, HIGH);
+    return false;
+  }
+  static void setPixel(byte i, uint32_t color) { strip.setPixelColor(i, color); }
+  static void show() { strip.show(); }
+};
+template <byte COUNT, byte PIN, byte PWR>
+Adafruit_NeoPixel StripBar<COUNT, PIN, PWR>::strip(COUNT, PIN, NEO_GRB + NEO_KHZ800);
+
+// ohne Balken, der Pin blinkt als Lebenszeichen (siehe loop())
+struct NoBar {
+  static const bool ENABLED = false;
+  static void begin(byte) {}
+  static void clear() {}
+  static void sleep() {}
+  static bool wake() { return true; }
+  static void setPixel(byte, uint32_t) {}
+  static void show() {}
+};
+
+template <bool C, typename A, typename B>
+struct Select {
+  typedef A type;
+};
+template <typename A, typename B>
+struct Select<false, A, B> {
+  typedef B type;
+};
+typedef Select<HAS_STRIP, StripBar<LED_STRIP_COUNT, LED_STRIP_PIN, LED_STRIP_PWR>, NoBar>::type Bar;
+
+void doTick();
+void doEdge(byte);
+void waitEvent(Event&);
+void periphBegin();
+void periphClaim(Periph);
+void periphRelease(Periph);
+void clockIdle(bool);
+bool isQuiet();
+void doDeepSleep();
+void eventsBegin();
+void doPumpControl();
+void doDryRunCheck();
+void setOutA(byte, bool);
+void setOutB(byte, bool);
+void flushOutputs();
+void pwmBegin();
+void pwmOutputs(byte, byte);
 void readAllInputs();
-void doAutoRestart();
+byte doAutoRestart(Pt*);
 byte getTankLevel();
 void pumpOff();
-void pumpOn();
 void ledOff();
 bool isTankFull();
 bool isFilterFull();
@@ -125,10 +566,81 @@ void doPump(bool);
 void doTankFull(bool);
 void doFilterFull(bool);
 void doStrip();
-byte getAverage(byte);
+byte getAverage(byte, byte);
+bool sampleDue();
+void sampleAdapt(word);
 void initAvr();
+byte cfgCrc(const Config&);
+void loadConfig();
+void applyConfig();
+void saveConfig();
+byte doCalibration(Pt*);
+void calBandgap();
+word readRawLevel(byte);
+byte warmCrc();
+void saveWarmState();
+bool restoreWarmState(byte);
+
+word readVccRaw();
+#ifdef telemetry
+void telBegin();
+void telWrite(byte);
+void telPrint(const char*);
+void telPrintP(const char*);
+void telPrint(word);
+void telEol();
+void telHold(bool);
+void telStart();
+void doTelemetry();
+#endif
+#ifdef cyclecounter
+uint32_t cycles();
+void cyclesBegin();
+#endif
+#ifdef instrument
+word stackFree();
+void statAdd(uint32_t);
+bool doStatReport();
+void doPowerReport();
+#endif
+#ifdef benchmark
+void benchBegin();
+void benchAdd(byte, uint32_t);
+void doBenchReport();
+#endif
+
+// läuft direkt nach dem Reset, noch vor den Konstruktoren und init().
+// Pumpenrelais und Pumpen LED sofort definiert aus, egal wie lange der Rest des Starts dauert.
+void earlyInit() __attribute__((naked, used, section(".init3")));
+void earlyInit() {
+  OUT_PUMP_PORT &= ~(_BV(OUT_PUMP_BIT) | _BV(LED_PUMP_BIT));
+  OUT_PUMP_DDR |= _BV(OUT_PUMP_BIT) | _BV(LED_PUMP_BIT);
+}
+
+#ifdef instrument
+// Ende von .bss/.noinit, ab hier bis zum Stack ist der RAM frei. Der Heap beginnt hier
+// (__heap_start), __brkval ist sein Ende (0 solange nichts allokiert wurde).
+extern byte _end;
+extern byte __heap_start;
+extern char* __brkval;
+
+// läuft nach dem Setzen des Stack Pointers (.init2), noch vor den Konstruktoren,
+// den freien RAM mit dem Muster füllen. Den Heap (Pixelpuffer des NeoPixel Objekts)
+// überschreibt malloc() danach wieder.
+void paintStack() __attribute__((naked, used, section(".init3")));
+void paintStack() {
+  byte* p = &_end;
+  while(p < (byte*)SP) {
+    *p++ = STACK_CANARY;
+  }
+}
+#endif
 
 void setup() {
+  // Reset Ursache sichern und zurücksetzen
+  byte rstFlags = MCUSR;
+  MCUSR = 0;
+
   // Ausgänge definieren
   pinMode(OUT_PUMP, OUTPUT);
   pinMode(LED_PUMP, OUTPUT);
@@ -146,88 +658,370 @@ void setup() {
   pumpOff();
   ledOff();
 
+  // Konfiguration laden
+  loadConfig();
+
   // Watchdog einschalten
   wdt_enable(WDTO_4S);
 
-  initAvr();
+  // nicht benutzte Module abschalten, ab hier ADC nur noch mit periphClaim()
+  periphBegin();
+  pwmBegin();
 
-// Anzeige initialisieren
-#ifdef ledstripe
-  strip.begin();
-  strip.setBrightness(BRIGHTNESS);
-  strip.show();
+  // nach dem geplanten Reset mit den alten Werten weiter machen
+  if(!restoreWarmState(rstFlags)) {
+    initAvr();
+  }
+
+#ifdef telemetry
+  telBegin();
+#endif
+#ifdef cyclecounter
+  cyclesBegin();
 #endif
+#ifdef benchmark
+  benchBegin();
+#endif
+
+// Anzeige initialisieren
+  Bar::begin(cfg.brightness);
+
+  // Pumpentaster beim Einschalten gedrückt -> Kalibrierung der Referenz und des Drucksensors
+  // (ohne Sensor nur die Referenz), läuft dann im Takt.
+  // Nur nach dem Einschalten (PORF), nie nach dem Watchdog Reset: wer dann gerade im Handbetrieb
+  // pumpt, würde sonst unbemerkt die Kalibrierung überschreiben.
+  calibrating = (rstFlags & _BV(PORF)) && isManualPump();
+
+  // ab jetzt läuft alles über Ereignisse
+  eventsBegin();
 }
 
 // automatische Resetzeit
-long autoRestart = MAX_AUTO_RESTART;  // einmal die Stunde, Rundenzeit ist etwas 250ms
+long autoRestart;  // einmal die Stunde, wird in loadConfig() gesetzt, nur in der Loop benutzt
 byte c = 0;
 
-bool tkFull, flFull, atMode, mnPump, pump;
-bool svPump;
+bool tkFull, flFull, atMode, mnPump;
+// Pegel über der Stoppschwelle, Tank gilt als voll
+bool lvlHigh;
+bool pumpWanted;
+bool relay;
+bool vccLow, vccCrit;
+// Sperre nach Unterspannung (pumpfsm.h)
+SupplyGuard supply;
+// Schattenregister der Ausgänge und Anzahl der eingesparten Port Zugriffe
+byte outA, outB;
+word outSkipped;
+word lvlRaw;
+// geglätteter Rohwert als Festkomma 12.4
+word lvlEma;
+// Trockenlaufschutz (pumpfsm.h)
+DryRun dry;
+// adaptive Nachlaufzeit (pumpfsm.h), zwischen pumpLapCount und RUN_ON_MAX_FACT * pumpLapCount
+RunOnAdapt runOn = {0, 0xFFFF, 0};
+// Anzahl der Pumpenstarts
+word pumpStarts;
+// Starts der letzten Stunde und Mindestpause
+StartGuard startGuard = {0xFFFF, 0, 0, 0, {0}};
+word loopUs;
+#ifdef instrument
+// Loop Zeit in µs: kleinster, größter Wert, gleitender Mittelwert (1/16), Histogramm
+word statMin = 0xFFFF;
+word statMax;
+word statAvg;
+byte statHist[STAT_BUCKETS];
+// längste Interruptsperre durch strip.show() in Zyklen
+word irqOffMax;
+byte statLaps;
+// Einschaltzeit der PRR Module in µs seit dem letzten Report
+uint32_t periphOnUs[P_COUNT];
+uint32_t periphSince[P_COUNT];
+uint32_t pwrStart;
+#endif
+// Anzahl der Nutzer je PRR Modul
+byte periphRefs[P_COUNT];
+// adaptive Abtastung: Abstand und Wartezeit in Takten, ruhige Messungen, letzter Rohwert
+byte sampleGap = 1;
+byte sampleWait;
+byte sampleStable;
+word sampleLast;
+// LEDs mit PWM, die gerade an sind: Hardware PWM, Software PWM (für den Timer0 Interrupt)
+byte pwmHw;
+volatile byte pwmSwA;
+volatile byte pwmSwB;
+// Anzeige: letzter Inhalt (Signatur), Runden ohne Änderung, seit der letzten Auffrischung, Balken aus, neu zeigen
+word stripSig;
+word stripIdle;
+byte stripRefresh;
+bool stripBlank;
+bool stripDirty = true;
+// Runden ohne Aktivität, Wecken durch den Watchdog Interrupt
+word quietTicks;
+volatile bool wdtWake;
 bool lvlerr;
-byte ppCounter;
+PumpFsm pumpFsm;
 byte tkLvl;
 
+// Ereignisse aus den Interrupts
+EventQueue<EVENT_QUEUE_SIZE> events;
+// Taktperiode in ms (aus der Loop änderbar), letzter Takt in ms, eine noch nicht bearbeitete Flanke
+DoubleBuffer<word> tickPeriod;
+word tickLast;
+volatile bool edgePending;
+
 void loop() {
-  // WatchDog verarbeiten
-  doAutoRestart();
+  Event ev;
+  // schlafen, bis ein Ereignis da ist
+  waitEvent(ev);
+  if(ev.type == EV_EDGE) {
+    doEdge(ev.data);
+  } else {
+    doTick();
+  }
+  // lange nichts los -> Tiefschlaf
+  if(DEEP_SLEEP && (cfg.sleepAfter > 0) && (quietTicks >= sleepLaps)) {
+    doDeepSleep();
+  }
+}
+
+// ein Durchlauf der Steuerung, einmal pro Takt (cfg.loopTime)
+void doTick() {
+  unsigned long loopStart = micros();
+#ifdef cyclecounter
+  uint32_t loopCycles = cycles();
+#endif
+#ifdef benchmark
+  benchInner = 0;
+#endif
+  // WatchDog verarbeiten, nach Ablauf der Zeit steht die Steuerung bis zum Reset
+  doAutoRestart(&ptRestart);
+  if(autoRestart <= 0) {
+    return;
+  }
   // alle Sensoren und Taster/Schalter lesen
-  readAllInputs();
+  BENCH(B_INPUTS, readAllInputs());
+  // während der Kalibrierung bleibt die Pumpe aus
+  if(calibrating) {
+    calibrating = doCalibration(&ptCal) == PT_WAITING;
+    pumpOff();
+    return;
+  }
   // Sensoren verarbeiten
-  doTankFull(tkFull);
+  doTankFull(tkFull || lvlHigh);
   doFilterFull(flFull);
 
-  // manueller Override der Pumpe
-  doManualPump();
-  // automatisches Pumpen
-  doAutoPump();
+  // Pegelanstieg beim Pumpen prüfen
+  doDryRunCheck();
+  // Pumpensteuerung, automatisch und manuell
+  BENCH(B_PUMP, doPumpControl());
   // Ausgabe der aktuellen Messungen auf dem Balken
-  doStrip();
-  // Mindestwartezeit eines Durchlauf
-  delay(LOOP_TIME);
-
-#ifndef ledstripe
-  digitalWrite(LED_STRIP_PIN, !digitalRead(LED_STRIP_PIN));
+  BENCH(B_STRIP, doStrip());
+  loopUs = word(micros() - loopStart);
+#ifdef benchmark
+  benchAdd(B_REST, cycles() - loopCycles - benchInner);
+  doBenchReport();
+#elif defined(instrument)
+  statAdd(cycles() - loopCycles);
+  if(!doStatReport()) {
+    doTelemetry();
+  }
+#elif defined(telemetry)
+  doTelemetry();
 #endif
+  if(!HAS_STRIP) {
+    setOutB(_BV(LED_STRIP_BIT), !(outB & _BV(LED_STRIP_BIT)));
+  }
+  // alle Ausgänge auf einmal schreiben
+  flushOutputs();
+  if(isQuiet()) {
+    if(quietTicks < 0xFFFF) {
+      quietTicks++;
+    }
+  } else {
+    quietTicks = 0;
+  }
+}
+
+// Ruhe: Pumpe aus und nichts, was demnächst etwas tun würde (Vorfilter, Taster, Handbetrieb,
+// Trockenlaufsperre, Startsperren, Kalibrierung)
+bool isQuiet() {
+  return !relay && !flFull && !mnPump && atMode && !calibrating && (dry.wait == 0) && ((pumpFsm.state == PS_IDLE) || (pumpFsm.state == PS_TANK_FULL)) &&
+         (startGuard.count == 0) && (startGuard.offTicks >= minOffLaps) && (supply.wait == 0);
 }
 
-// do the automatic pump operation
-void doAutoPump() {
-  digitalWrite(LED_AUTO, !atMode);
-  if(atMode) {
-    if((flFull || mnPump) && !tkFull) {
-      ppCounter = PUMP_LAP_COUNT;
+// Tiefschlaf: Anzeige und LEDs aus, im Power-down steht Timer0 und damit millis().
+// Der Watchdog läuft im Interrupt+Reset Modus: sein Interrupt weckt alle 8s, der Pegel wird
+// gemessen und die verschlafene Zeit auf die Zähler gebucht. Kommt der Interrupt nicht mehr
+// dran (Hänger), löst der nächste Ablauf wie bisher den Reset aus.
+// Zurück geht es bei einem Pin Change, einer Pegeländerung oder wenn der Autoreset ansteht.
+void doDeepSleep() {
+  if(!HAS_STRIP) {
+    setOutB(_BV(LED_STRIP_BIT), false);
+  }
+  ledOff();
+  // der Balken bleibt nach dem Wecken aus, bis sich die Anzeige ändert
+  Bar::sleep();
+  stripBlank = true;
+  stripIdle = 0xFFFF;
+  set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+  word laps = word(DEEP_SLEEP_WAKE) * loopCorFact;
+  while(true) {
+    noInterrupts();
+    wdtWake = false;
+    wdt_reset();
+    // zeitkritische Folge (4 Takte), beide Werte sind Konstanten
+    WDTCSR = _BV(WDCE) | _BV(WDE);
+    WDTCSR = _BV(WDIE) | _BV(WDE) | WDT_8S_BITS;
+    if(!events.empty()) {
+      interrupts();
+      break;
+    }
+    sleep_enable();
+    interrupts();
+    sleep_cpu();
+    sleep_disable();
+    if(!wdtWake) {
+      // Pin Change
+      break;
     }
-    if (tkFull) {
-      ppCounter = 0;
+    // verschlafene Zeit nachbuchen, den Autoreset selbst macht der nächste Takt
+    if(autoRestart <= laps) {
+      autoRestart = 1;
+      break;
     }
-    if(ppCounter > 0) {
-      pump = true;
-      pumpOn();
-      ppCounter--;
-    } else {
-      pump = false;
-      pumpOff();
+    autoRestart -= laps;
+    runOn.gapTicks = (runOn.gapTicks > 0xFFFF - laps) ? 0xFFFF : runOn.gapTicks + laps;
+    if(HAS_SENSOR) {
+      periphClaim(P_ADC);
+      tkLvl = getTankLevel();
+      periphRelease(P_ADC);
+      word delta = (lvlRaw > sampleLast) ? lvlRaw - sampleLast : sampleLast - lvlRaw;
+      if(delta > SAMPLE_DELTA) {
+        break;
+      }
     }
   }
+  wdt_enable(WDTO_4S);
+  quietTicks = 0;
+  sampleGap = 1;
+  sampleStable = 0;
 }
 
-// manueller Override der Pumpe
-void doManualPump() {
-  if(!atMode) {
-    if(mnPump) {
-      if(!svPump) {
-        pumpOn();
-        svPump = true;
-      }
-    } else {
-      if(svPump) {
-        pumpOff();
-        svPump = false;
-      }
+// Watchdog Interrupt, nur im Tiefschlaf eingeschaltet
+ISR(WDT_vect) { wdtWake = true; }
+
+// Flanke an einem Eingang: ist der Tank jetzt voll, wird die Pumpe im Automatikbetrieb sofort abgeschaltet
+// und nicht erst mit dem nächsten Takt. Der Automat geht dabei mit nach TANK_FULL, prellt der Schwimmer
+// zurück, startet die Pumpe erst nach der Mindestpause wieder. Alles andere erledigt der nächste Takt.
+void doEdge(byte in) {
+  edgePending = false;
+  bool full = !(in & _BV(SEN_TANK_FULL_BIT));
+  byte prev = pumpFsm.state;
+  if(full && relay && pumpFsmTankEdge(pumpFsm)) {
+    runOnAdaptStep(runOn, prev, pumpFsm.state, pumpLapCount);
+    pumpOff();
+    startGuardSwitch(startGuard, false);
+  }
+}
+
+// nächstes Ereignis holen, bei leerer Warteschlange im Idle Modus schlafen (Timer laufen weiter).
+// Die Prüfung vor dem Schlafen erfolgt mit gesperrten Interrupts, sei und sleep werden
+// direkt hintereinander ausgeführt, so geht kein Ereignis verloren.
+// Geschlafen wird mit reduziertem Takt, zurück auf 8 MHz erst wenn ein Ereignis da ist,
+// die Interrupts für millis() dazwischen laufen langsam.
+void waitEvent(Event& ev) {
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  while(!events.pop(ev)) {
+    noInterrupts();
+    if(events.empty()) {
+      clockIdle(true);
+      sleep_enable();
+      interrupts();
+      sleep_cpu();
+      sleep_disable();
     }
+    interrupts();
   }
+  clockIdle(false);
+}
+
+// Systemtakt und Timer0 Vorteiler gemeinsam umschalten, ohne Interrupt dazwischen.
+// clock_prescale_set() hält die 4 Takte zwischen den beiden CLKPR Zugriffen ein.
+bool clkIdle;
+void clockIdle(bool idle) {
+  if(!CLOCK_SCALING || (idle == clkIdle)) {
+    return;
+  }
+  byte sreg = SREG;
+  noInterrupts();
+  clock_prescale_set(idle ? clock_div_8 : clock_div_1);
+  TCCR0B = (TCCR0B & ~T0_CS_MASK) | (idle ? T0_CS_IDLE : T0_CS_RUN);
+  clkIdle = idle;
+  SREG = sreg;
+}
+
+// Takt über Timer0 Compare A (Timer0 läuft für millis() sowieso), Pin Change Interrupts der Eingänge
+void eventsBegin() {
+  tickPeriod.write(cfg.loopTime);
+  tickLast = word(millis());
+  TIFR0 = _BV(OCF0A);
+  TIMSK0 |= _BV(OCIE0A);
+  PCMSK0 |= IN_MASK_A;
+  PCMSK1 |= IN_MASK_B;
+  GIFR = _BV(PCIF0) | _BV(PCIF1);
+  GIMSK |= _BV(PCIE0) | _BV(PCIE1);
+}
+
+// alle 256 Timer0 Schritte (~2ms) bei TCNT0 = 0: Software PWM LEDs an,
+// ein Takt wenn cfg.loopTime vergangen ist
+ISR(TIM0_COMPA_vect) {
+  PORTA |= pwmSwA;
+  PORTB |= pwmSwB;
+  word now = word(millis());
+  word period = tickPeriod.read();
+  if(word(now - tickLast) >= period) {
+    tickLast += period;
+    Event ev = {EV_TICK, 0};
+    events.push(ev);
+  }
+}
+
+// Flanke an einem der Eingänge, mehrere Flanken (Prellen) bis zur Bearbeitung ergeben ein Ereignis.
+// Ist die Warteschlange voll, bleibt edgePending aus, die nächste Flanke versucht es wieder.
+ISR(PCINT0_vect) {
+  if(!edgePending) {
+    Event ev = {EV_EDGE, byte((PINA & IN_MASK_A) | ((PINB & IN_MASK_B) << 3))};
+    edgePending = events.push(ev);
+  }
+}
+
+ISR(PCINT1_vect, ISR_ALIASOF(PCINT0_vect));
+
+// Pumpensteuerung: ein Schritt des Zustandsautomaten, das Relais wird nur bei einer Änderung geschaltet.
+// Bei Unterspannung wird die Pumpe nicht gestartet. Bricht die Spannung bei laufender Pumpe bis unter die
+// kritische Schwelle ein, geht der Automat in den Fehlerzustand und bleibt danach eine Weile gesperrt (SupplyGuard).
+// Damit flattert das Relais nicht, wenn der Anlaufstrom die Versorgung einbrechen lässt.
+void doPumpControl() {
+  setOutA(_BV(LED_AUTO_BIT), !atMode);
+  byte in = (atMode ? PI_AUTO : 0) | (flFull ? PI_FILTER : 0) | ((tkFull || lvlHigh) ? PI_TANK : 0) | (mnPump ? PI_BUTTON : 0) |
+            ((supplyGuardStep(supply, vccCrit, relay, loopCorFact) || dry.wait) ? PI_FAULT : 0) |
+            (startGuardStep(startGuard, relay, cfg.maxStarts, startSlotLaps, minOffLaps) ? PI_HOLD : 0);
+  byte prev = pumpFsm.state;
+  pumpWanted = pumpFsmStep(pumpFsm, in, runOn.laps);
+  runOnAdaptStep(runOn, prev, pumpFsm.state, pumpLapCount);
+  bool on = pumpWanted && !vccCrit && (relay || !vccLow);
+  if(on != relay) {
+    if(on) {
+      pumpStarts++;
+    }
+    startGuardSwitch(startGuard, on);
+    doPump(on);
+  }
+}
+
+// Trockenlaufschutz, nur im Automatikbetrieb bei laufender Pumpe und gültigem Sensor
+void doDryRunCheck() {
+  bool pumping = relay && ((pumpFsm.state == PS_FILLING) || (pumpFsm.state == PS_RUN_ON));
+  dryRunStep(dry, HAS_SENSOR && pumping && !lvlerr, lvlEma, loopCorFact);
 }
 
 void readAllInputs() {
@@ -235,46 +1029,167 @@ void readAllInputs() {
   flFull = isFilterFull();
   atMode = isAutoMode();
   mnPump = isManualPump();
-  tkLvl = getTankLevel();
+  if(sampleDue()) {
+    periphClaim(P_ADC);
+    if(HAS_SENSOR) {
+      tkLvl = getTankLevel();
+    }
+    // Versorgungsspannung mit Hysterese über die beiden Schwellen
+    word vcc = readVccRaw();
+    vccLow = vcc > vccStartRaw;
+    vccCrit = vcc > vccMinRaw;
+    periphRelease(P_ADC);
+    sampleAdapt(lvlRaw);
+  }
+  // Stoppschwelle mit Hysterese, bei Sensorfehler zählt nur noch der Schwimmerschalter
+  if(!HAS_SENSOR || lvlerr || (cfg.stopLvl == 0)) {
+    lvlHigh = false;
+  } else if(tkLvl >= cfg.stopLvl) {
+    lvlHigh = true;
+  } else if(tkLvl < cfg.stopLvl - cfg.stopHyst) {
+    lvlHigh = false;
+  }
+}
+
+// ist in diesem Takt eine Messung fällig? Bei Aktivität sofort wieder jeden Takt.
+bool sampleDue() {
+  if(relay || flFull || mnPump) {
+    sampleGap = 1;
+    sampleStable = 0;
+  }
+  if(++sampleWait < sampleGap) {
+    return false;
+  }
+  sampleWait = 0;
+  return true;
+}
+
+// Abtastabstand an die Änderung des Rohwerts anpassen (ohne Sensor bleibt lvlRaw 0, also ruhig)
+void sampleAdapt(word raw) {
+  word delta = (raw > sampleLast) ? raw - sampleLast : sampleLast - raw;
+  sampleLast = raw;
+  if(delta > SAMPLE_DELTA) {
+    sampleGap = 1;
+    sampleStable = 0;
+  } else if((++sampleStable >= SAMPLE_STABLE) && (sampleGap < SAMPLE_MAX_GAP)) {
+    sampleGap <<= 1;
+    sampleStable = 0;
+  }
+}
+
+// interne 1,1V Referenz gegen Vcc messen, die erste Wandlung nach dem Umschalten wird verworfen
+word readVccRaw() {
+  ADMUX = _BV(MUX5) | _BV(MUX0);
+  delayMicroseconds(500);
+  for(byte i = 0; i < 2; i++) {
+    ADCSRA |= _BV(ADSC);
+    while(ADCSRA & _BV(ADSC));
+  }
+  return ADC;
 }
 
 // WatchDog triggern und nach definierter Zeit einen Reset provozieren
-void doAutoRestart() {
-  // Counter bis zu Reset erniedrigen
-  autoRestart--;
-  if(autoRestart > 0) {
-    // wenn noch wartezeit übrig ist, dann den Watchdog triggern
+// Protothread, ein Schritt pro Takt
+byte doAutoRestart(Pt* pt) {
+#ifdef telemetry
+  const byte blink = _BV(LED_AUTO_BIT);
+#else
+  const byte blink = _BV(LED_PUMP_BIT);
+#endif
+  PT_BEGIN(pt);
+  // Counter bis zu Reset erniedrigen, solange noch Wartezeit übrig ist den Watchdog triggern
+  while(--autoRestart > 0) {
     wdt_reset();
-  } else {
-    // Wartezeit verstrichen, Watchdog löst nun den Reset aus
-    pumpOff();
-    ledOff();
-    while(true) {
-      // solange hektisch blinken bitte...
-      digitalWrite(LED_PUMP, !digitalRead(LED_PUMP));
-      delay(100);
-    }
+    PT_YIELD(pt);
   }
+  // Wartezeit verstrichen, Watchdog löst nun den Reset aus
+  saveWarmState();
+  ledOff();
+  pumpOff();
+  while(true) {
+    // solange hektisch blinken bitte...
+    setOutA(blink, !(outA & blink));
+    flushOutputs();
+    PT_YIELD(pt);
+  }
+  PT_END(pt);
+}
+
+// alle PRR Module aus, der Analogkomparator wird nie gebraucht (kein PRR Bit, eigener Schalter).
+// Der ADC muss vor dem Abschalten über ADEN gestoppt werden.
+void periphBegin() {
+  ACSR |= _BV(ACD);
+  ADCSRA &= ~_BV(ADEN);
+  for(byte p = 0; p < P_COUNT; p++) {
+    PRR |= PERIPH_PRR[p];
+  }
+#ifdef instrument
+  pwrStart = micros();
+#endif
+}
+
+// Modul anfordern, der erste Nutzer schaltet es ein
+void periphClaim(Periph p) {
+  if(periphRefs[p]++ > 0) {
+    return;
+  }
+  PRR &= ~PERIPH_PRR[p];
+  if(p == P_ADC) {
+    ADCSRA |= _BV(ADEN);
+  }
+#ifdef instrument
+  periphSince[p] = micros();
+#endif
+}
+
+// Modul freigeben, der letzte Nutzer schaltet es ab
+void periphRelease(Periph p) {
+  if(--periphRefs[p] > 0) {
+    return;
+  }
+  if(p == P_ADC) {
+    ADCSRA &= ~_BV(ADEN);
+  }
+  PRR |= PERIPH_PRR[p];
+#ifdef instrument
+  periphOnUs[p] += micros() - periphSince[p];
+#endif
 }
 
 // getting the average tank level
 byte getTankLevel() {
   lvlerr = false;
   word lvl = analogRead(SEN_TANK_FLOAT);
-  if(lvl < ERR_LVL) {
+  lvlRaw = lvl;
+  // exponentielle Glättung (1/8) in Festkomma, Startwert direkt übernehmen
+  if(lvlEma == 0) {
+    lvlEma = lvl << 4;
+  } else {
+    lvlEma += (int16_t((lvl << 4) - lvlEma)) >> 3;
+  }
+  if(lvl < cfg.errLvl) {
     lvlerr = true;
     return 0;
   }
-  if(lvl < MIN_LVL) {
+  if(lvl < cfg.minLvl) {
     return 0;
   }
-  byte percent = byte(map(lvl, MIN_LVL, MAX_LVL, 0, 100));
-  return getAverage(percent);
+  byte percent = 100;
+  if(lvl < cfg.maxLvl) {
+    percent = byte((word(lvl - cfg.minLvl) * lvlScale) >> 16);
+  }
+  if(BUILD.filter == Filter::None) {
+    return percent;
+  }
+  byte avg;
+  BENCH(B_AVERAGE, avg = getAverage(percent, (sampleGap > 1) ? SPARSE_LVLS : MAX_LVLS));
+  return avg;
 }
 
 // calculate the average without the min and max value of the last n level measurements
-byte getAverage(byte newValue) {
+byte getAverage(byte newValue, byte n) {
   lvls[pos] = newValue;
+  byte i = pos;
   // next position within the array
   pos = byte(((pos + 1) % MAX_LVLS));
   // building the average
@@ -282,8 +1197,8 @@ byte getAverage(byte newValue) {
   byte min, max;
   min = 100;
   max = 0;
-  // sum all up, determine min and max
-  for(byte i = 0; i < MAX_LVLS; i++) {
+  // sum up the last n values backwards from the newest, determine min and max
+  for(byte k = 0; k < n; k++) {
     sum += lvls[i];
     if(lvls[i] < min) {
       min = lvls[i];
@@ -291,11 +1206,12 @@ byte getAverage(byte newValue) {
     if(lvls[i] > max) {
       max = lvls[i];
     }
+    i = (i == 0) ? MAX_LVLS - 1 : i - 1;
   }
   // remove the min and the max from the sum
   sum -= (min + max);
   // build average, divide the sum with the count of measure points minus 2 (min and max)
-  return byte(sum / (MAX_LVLS - 2));
+  return byte(sum / (n - 2));
 }
 
 // initialise the average building array
@@ -306,22 +1222,203 @@ void initAvr() {
   pos = 0;
 }
 
-// schalte Pumpe aus
-void pumpOff() { doPump(false); }
+// Prüfsumme über die Konfiguration (ohne das crc Feld selbst)
+byte cfgCrc(const Config& c) {
+  byte crc = 0;
+  const byte* p = (const byte*)&c;
+  for(byte i = 0; i < offsetof(Config, crc); i++) {
+    crc = _crc8_ccitt_update(crc, p[i]);
+  }
+  return crc;
+}
+
+// Konfiguration aus dem EEPROM laden, bei ungültigem Inhalt die Standardwerte nehmen
+// und die abgeleiteten Rundenzahlen berechnen
+void loadConfig() {
+  eeprom_read_block(&cfg, &eeCfg, sizeof(Config));
+  bool valid = (cfg.version == CFG_VERSION) && (cfg.crc == cfgCrc(cfg)) && (cfg.loopTime >= 10) && (cfg.errLvl < cfg.minLvl) &&
+               (cfg.minLvl < cfg.maxLvl) && (cfg.maxLvl <= 1023) && (cfg.autoRestart > 0) && (word(cfg.runOnTime) * (1000 / cfg.loopTime) <= 255) && (cfg.maxStarts > 0) &&
+               (cfg.stopLvl <= 100) && ((cfg.stopLvl == 0) || (cfg.stopHyst < cfg.stopLvl)) && (cfg.vccMin > 0) && (cfg.vccMin < cfg.vccStart) &&
+               (cfg.bandgap >= BANDGAP_MIN) && (cfg.bandgap <= BANDGAP_MAX);
+  if(!valid) {
+    memcpy_P(&cfg, &CFG_DEFAULT, sizeof(Config));
+    saveConfig();
+  }
+  applyConfig();
+}
+
+// abgeleitete Werte aus cfg berechnen, nach jeder Änderung der Konfiguration aufrufen
+void applyConfig() {
+  loopCorFact = 1000 / cfg.loopTime;
+  pumpLapCount = cfg.runOnTime * loopCorFact;
+  runOn.laps = pumpLapCount;
+  autoRestart = long(cfg.autoRestart) * 60L * loopCorFact;
+  minOffLaps = word(cfg.minOffTime) * loopCorFact;
+  startSlotLaps = START_SLOT_TIME * loopCorFact;
+  long sleep = long(cfg.sleepAfter) * 60L * loopCorFact;
+  sleepLaps = sleep > 0xFFFF ? 0xFFFF : word(sleep);
+  blankLaps = word(cfg.blankAfter) * loopCorFact;
+  lvlScale = (100UL << 16) / (cfg.maxLvl - cfg.minLvl);
+  vccStartRaw = VCC_RAW(cfg.bandgap, cfg.vccStart);
+  vccMinRaw = VCC_RAW(cfg.bandgap, cfg.vccMin);
+}
+
+// Konfiguration mit neuer Prüfsumme ins EEPROM schreiben, es werden nur geänderte Bytes geschrieben
+void saveConfig() {
+  cfg.version = CFG_VERSION;
+  cfg.crc = cfgCrc(cfg);
+  eeprom_update_block(&cfg, &eeCfg, sizeof(Config));
+}
+
+// gemittelter Rohwert des Drucksensors über n Messungen
+word readRawLevel(byte n) {
+  periphClaim(P_ADC);
+  word sum = 0;
+  for(byte i = 0; i < n; i++) {
+    sum += analogRead(SEN_TANK_FLOAT);
+  }
+  periphRelease(P_ADC);
+  return sum / n;
+}
+
+// interne Referenz gegen die Versorgung messen, die dabei VCC_CAL haben muss (geregelte 5V).
+// Liegt das Ergebnis außerhalb der Toleranz aus dem Datenblatt, bleibt der alte Wert.
+void calBandgap() {
+  periphClaim(P_ADC);
+  word sum = 0;
+  for(byte i = 0; i < VCC_CAL_SAMPLES; i++) {
+    sum += readVccRaw();
+  }
+  periphRelease(P_ADC);
+  word bg = word(uint32_t(sum) * VCC_CAL / (1024UL * VCC_CAL_SAMPLES));
+  if((bg >= BANDGAP_MIN) && (bg <= BANDGAP_MAX)) {
+    cfg.bandgap = bg;
+    saveConfig();
+    applyConfig();
+  }
+}
+
+// Kalibrierung des Drucksensors und der internen Referenz (calBandgap(), beim Einstieg)
+// Der Schalter Auto/Man wählt den Messpunkt: Man = Tank leer, Auto = Tank voll.
+// Ein Druck auf den Pumpentaster übernimmt den gemittelten Messwert (LED Tank voll bzw. Filter voll leuchtet dann).
+// Jeder Punkt wird sofort gespeichert, wenn er zum anderen, bereits gespeicherten Punkt passt
+// (leer < voll, über errLvl). So reicht es, einen Punkt neu zu messen, und es gehen keine Messungen
+// verloren, wenn zwischen den beiden Punkten mehr als CAL_TIMEOUT vergeht.
+// Sind beide Punkte gemessen, ist die Kalibrierung fertig, ohne Eingabe wird sie nach CAL_TIMEOUT Sekunden verlassen.
+// Ohne Drucksensor wird nur die Referenz ausgemessen.
+// Protothread, ein Schritt pro Takt, die Eingänge kommen aus readAllInputs().
+byte doCalibration(Pt* pt) {
+  static bool gotMin;
+  static bool gotMax;
+  static word idle;
+  static bool pressed;
+  PT_BEGIN(pt);
+  // Pumpe ist aus, die Versorgung hat ihren Nennwert: Referenz ausmessen
+  calBandgap();
+  gotMin = false;
+  gotMax = false;
+  idle = 0;
+  pressed = true;  // Taster ist beim Einstieg noch gedrückt
+  while(HAS_SENSOR && (idle < word(CAL_TIMEOUT) * loopCorFact)) {
+    PT_YIELD(pt);
+    idle++;
+    // blinkende Auto LED zeigt den Kalibriermodus an
+    setOutA(_BV(LED_AUTO_BIT), (idle >> 1) & 1);
+    setOutA(_BV(LED_TANK_FULL_BIT), gotMin);
+    setOutB(_BV(LED_FILTER_FULL_BIT), gotMax);
+    bool btn = mnPump;
+    if(btn && !pressed) {
+      idle = 0;
+      word lvl = readRawLevel(CAL_SAMPLES);
+      // unplausible Werte werden nicht übernommen, die LED bleibt dann aus
+      if(atMode && (lvl > cfg.minLvl)) {
+        cfg.maxLvl = lvl;
+        gotMax = true;
+        saveConfig();
+        applyConfig();
+      } else if(!atMode && (lvl > cfg.errLvl) && (lvl < cfg.maxLvl)) {
+        cfg.minLvl = lvl;
+        gotMin = true;
+        saveConfig();
+        applyConfig();
+      }
+    }
+    pressed = btn;
+    if(gotMin && gotMax) {
+      break;
+    }
+  }
+  ledOff();
+  initAvr();
+  PT_END(pt);
+}
+
+// Prüfsumme über den Warmstart Bereich (ohne das crc Feld selbst)
+byte warmCrc() {
+  byte crc = 0;
+  const byte* p = (const byte*)&warm;
+  for(byte i = 0; i < offsetof(WarmState, crc); i++) {
+    crc = _crc8_ccitt_update(crc, p[i]);
+  }
+  return crc;
+}
+
+// Zustand vor dem geplanten Reset in den .noinit Bereich retten
+void saveWarmState() {
+  warm.magic = WARM_MAGIC;
+  for(byte i = 0; i < MAX_LVLS; i++) {
+    warm.lvls[i] = lvls[i];
+  }
+  warm.pos = pos;
+  warm.pumpFsm = pumpFsm;
+  warm.runOnLaps = runOn.laps;
+  warm.startCount = startGuard.count;
+  warm.dryWait = dry.wait;
+  warm.dryTrips = dry.trips;
+  warm.restarts++;
+  warm.crc = warmCrc();
+}
+
+// Zustand nach einem Watchdog Reset wiederherstellen, nur wenn Magic und CRC passen
+bool restoreWarmState(byte rstFlags) {
+  bool valid = (rstFlags & _BV(WDRF)) && (warm.magic == WARM_MAGIC) && (warm.crc == warmCrc()) && (warm.pos < MAX_LVLS) && (warm.pumpFsm.state < PS_COUNT) &&
+               (warm.dryTrips <= DRY_MAX_TRIPS);
+  // Bereich sofort ungültig machen, ein unerwarteter Reset darf die alten Werte nicht noch einmal laden
+  warm.magic = 0;
+  if(!valid) {
+    warm.restarts = 0;
+    return false;
+  }
+  for(byte i = 0; i < MAX_LVLS; i++) {
+    lvls[i] = warm.lvls[i];
+  }
+  pos = warm.pos;
+  pumpFsm = warm.pumpFsm;
+  if(warm.runOnLaps > runOn.laps) {
+    runOn.laps = warm.runOnLaps;
+  }
+  // die Starts der letzten Stunde zählen weiter, alle im aktuellen Abschnitt (im Zweifel länger gesperrt)
+  startGuard.count = warm.startCount;
+  startGuard.slots[startGuard.slot] = warm.startCount;
+  // eine laufende Trockenlaufsperre gilt auch nach dem Reset weiter
+  dry.wait = warm.dryWait;
+  dry.trips = warm.dryTrips;
+  return true;
+}
+
+// schalte Pumpe sofort aus
+void pumpOff() {
+  doPump(false);
+  flushOutputs();
+}
 
-// schalte Pumpe aus
-void pumpOn() { doPump(true); }
 
 // Alle LEDs aus
 void ledOff() {
-  digitalWrite(LED_PUMP, 0);
-  digitalWrite(LED_TANK_FULL, 0);
-  digitalWrite(LED_FILTER_FULL, 0);
-  digitalWrite(LED_AUTO, 0);
-#ifdef ledstripe
-  strip.clear();
-  strip.show();
-#endif
+  setOutA(_BV(LED_PUMP_BIT) | _BV(LED_TANK_FULL_BIT) | _BV(LED_AUTO_BIT), false);
+  setOutB(_BV(LED_FILTER_FULL_BIT), false);
+  flushOutputs();
+  Bar::clear();
 }
 
 // Ist die Hauptwassertonne schon voll?
@@ -338,45 +1435,535 @@ bool isManualPump() { return !digitalRead(SWT_PUMP_MAN); }
 
 // Pumpe ein/ausschalten
 void doPump(bool start) {
-  digitalWrite(LED_PUMP, start);
-  digitalWrite(OUT_PUMP, start);
+  relay = start;
+  setOutA(_BV(OUT_PUMP_BIT) | _BV(LED_PUMP_BIT), start);
 }
 
 // Signal LED "Tonne voll" de/aktivieren
-void doTankFull(bool full) { digitalWrite(LED_TANK_FULL, full); }
+void doTankFull(bool full) { setOutA(_BV(LED_TANK_FULL_BIT), full); }
 
 // Signal LED "Vorfilter voll" de/aktivieren
-void doFilterFull(bool full) { digitalWrite(LED_FILTER_FULL, full); }
+void doFilterFull(bool full) { setOutB(_BV(LED_FILTER_FULL_BIT), full); }
+
+// Bits im Schattenregister setzen/löschen, geschrieben wird erst in flushOutputs()
+void setOutA(byte mask, bool on) {
+  if(on) {
+    outA |= mask;
+  } else {
+    outA &= ~mask;
+  }
+}
+
+void setOutB(byte mask, bool on) {
+  if(on) {
+    outB |= mask;
+  } else {
+    outB &= ~mask;
+  }
+}
+
+// Schattenregister auf die Ports schreiben, aber nur wenn sich etwas geändert hat.
+// Verglichen wird mit dem Port selbst, direkte Zugriffe auf den Port fallen so auch auf.
+void flushOutputs() {
+  byte a = outA & PORT_MASK_A;
+  if((PORTA & PORT_MASK_A) != a) {
+    // PORTA teilt sich das Register mit dem UART und der Software PWM im Interrupt, daher atomar
+    noInterrupts();
+    PORTA = (PORTA & ~PORT_MASK_A) | a;
+    interrupts();
+  } else {
+    outSkipped++;
+  }
+  byte b = outB & PORT_MASK_B;
+  if((PORTB & PORT_MASK_B) != b) {
+    noInterrupts();
+    PORTB = (PORTB & ~PORT_MASK_B) | b;
+    interrupts();
+  } else {
+    outSkipped++;
+  }
+  pwmOutputs(outA, outB);
+}
+
+// Timer0 läuft für millis() schon im Fast PWM (Arduino init()), Compare A bei 0 ist der Anfang
+// der Periode (auch der Takt Interrupt), Compare B das Ende der Einschaltzeit.
+// Timer1 im 8 Bit Fast PWM mit Vorteiler 8 (3,9kHz, im Leerlauf mit 1 MHz 488Hz).
+void pwmBegin() {
+  OCR0A = 0;
+  OCR0B = LED_DUTY;
+#ifndef telemetry
+  periphClaim(P_TIMER1);
+  TCCR1A = _BV(WGM10);
+  TCCR1B = _BV(WGM12) | _BV(CS11);
+  OCR1A = LED_DUTY;
+  OCR1B = LED_DUTY;
+  periphRelease(P_TIMER1);
+#endif
+}
+
+// PWM LEDs nach den Schattenregistern schalten, nur bei Änderung
+void pwmOutputs(byte a, byte b) {
+  byte hw = a & PWM_HW_A;
+  byte swA = a & PWM_SW_A;
+  byte swB = b & PWM_SW_B;
+  if((hw == pwmHw) && (swA == pwmSwA) && (swB == pwmSwB)) {
+    return;
+  }
+  if(hw & _BV(LED_AUTO_BIT)) {
+    TCCR0A |= _BV(COM0B1);
+  } else {
+    TCCR0A &= ~_BV(COM0B1);
+  }
+#ifndef telemetry
+  // Timer1 nur einschalten, solange eine seiner LEDs leuchtet
+  bool t1 = hw & PWM_T1_A;
+  bool t1Was = pwmHw & PWM_T1_A;
+  if(t1 && !t1Was) {
+    periphClaim(P_TIMER1);
+  }
+  byte com = ((hw & _BV(LED_TANK_FULL_BIT)) ? _BV(COM1A1) : 0) | ((hw & _BV(LED_PUMP_BIT)) ? _BV(COM1B1) : 0);
+  TCCR1A = (TCCR1A & ~(_BV(COM1A1) | _BV(COM1B1))) | com;
+  if(!t1 && t1Was) {
+    periphRelease(P_TIMER1);
+  }
+#endif
+  pwmHw = hw;
+  // Software PWM: ausgeschaltete LEDs sofort low, nicht erst am Ende der Periode
+  // (vor dem Tiefschlaf kommt kein Interrupt mehr)
+  noInterrupts();
+  pwmSwA = swA;
+  pwmSwB = swB;
+  PORTA &= ~(PWM_SW_A & ~swA);
+  PORTB &= ~(PWM_SW_B & ~swB);
+  if(swA | swB) {
+    TIMSK0 |= _BV(OCIE0B);
+  } else {
+    TIMSK0 &= ~_BV(OCIE0B);
+  }
+  interrupts();
+}
 
+// Ende der Einschaltzeit der Software PWM
+ISR(TIM0_COMPB_vect) {
+  PORTA &= ~PWM_SW_A;
+  PORTB &= ~PWM_SW_B;
+}
+
+// Der Balken wird nur bei einer Änderung der Anzeige (oder einmal pro Sekunde) neu geschrieben.
+// Nach cfg.blankAfter Sekunden ohne Änderung geht er aus, Taster oder Änderung schalten ihn wieder ein.
 void doStrip() {
-#ifdef ledstripe
+  if(!Bar::ENABLED) {
+    return;
+  }
+  int8_t lvl = map(tkLvl, 0, 100, -1, 5);
+  bool pumpHeld = !relay && vccLow && pumpWanted;
+  word sig = byte(lvl + 1) | (lvlerr << 3) | ((tkFull || lvlHigh) << 4) | (flFull << 5) | (relay << 6) | (pumpHeld << 7) | (mnPump << 8);
+  bool changed = sig != stripSig;
+  stripSig = sig;
+  if(changed || mnPump) {
+    stripIdle = 0;
+  } else if(stripIdle < 0xFFFF) {
+    stripIdle++;
+  }
+  if((cfg.blankAfter > 0) && (stripIdle >= blankLaps)) {
+    if(!stripBlank) {
+      Bar::sleep();
+      stripBlank = true;
+    }
+    return;
+  }
+  if(stripBlank) {
+    stripBlank = false;
+    stripDirty = true;
+    if(!Bar::wake()) {
+      return;
+    }
+  }
+  if(!changed && !stripDirty && (++stripRefresh < loopCorFact)) {
+    return;
+  }
+  stripRefresh = 0;
+  stripDirty = false;
   for(byte i = 0; i < 3; i++) {
-    strip.setPixelColor(i, strip.Color(32, 32, 32));
+    Bar::setPixel(i, LED_GREY);
   }
   if(lvlerr) {
     for(int8_t i = 0; i < 5; i++) {
-      strip.setPixelColor(LED_STRIP_COUNT - i - 1, LED_BLACK);
+      Bar::setPixel(LED_STRIP_COUNT - i - 1, LED_BLACK);
     }
-      strip.setPixelColor(7, LED_RED);
+    Bar::setPixel(7, LED_RED);
   } else {
-    int8_t lvl = map(tkLvl, 0, 100, -1, 5);
     for(int8_t i = 0; i < 5; i++) {
       if(i <= lvl) {
-        strip.setPixelColor(LED_STRIP_COUNT - i - 1, LED_GREEN);
+        Bar::setPixel(LED_STRIP_COUNT - i - 1, LED_GREEN);
       } else {
-        strip.setPixelColor(LED_STRIP_COUNT - i - 1, LED_BLACK);
+        Bar::setPixel(LED_STRIP_COUNT - i - 1, LED_BLACK);
       }
     }
   }
-  if(tkFull) {
-    strip.setPixelColor(2, LED_RED);
+  if(tkFull || lvlHigh) {
+    Bar::setPixel(2, LED_RED);
   }
   if(flFull) {
-    strip.setPixelColor(1, LED_RED);
+    Bar::setPixel(1, LED_RED);
   }
-  if(pump || mnPump) {
-    strip.setPixelColor(0, LED_GREEN);
+  if(relay) {
+    Bar::setPixel(0, LED_GREEN);
+  } else if(pumpHeld) {
+    // Pumpe soll laufen, wird aber wegen Unterspannung zurückgehalten
+    Bar::setPixel(0, LED_BLUE);
   }
-  strip.show();
+#ifdef telemetry
+  // strip.show() sperrt die Interrupts, das würde ein laufendes Zeichen zerstören
+  telHold(true);
+#endif
+#ifdef instrument
+  uint32_t showStart = cycles();
+#endif
+  Bar::show();
+#ifdef instrument
+  word irqOff = word(cycles() - showStart);
+  if(irqOff > irqOffMax) {
+    irqOffMax = irqOff;
+  }
+#endif
+#ifdef telemetry
+  telHold(false);
+#endif
+}
+
+#ifdef telemetry
+// Ringpuffer, telHead wird nur von der Loop, telTail nur vom Interrupt geschrieben
+byte telBuf[TEL_BUF_SIZE];
+volatile byte telHead, telTail;
+// aktuelles Zeichen inkl. Start- und Stopbit, Anzahl der noch zu sendenden Bits
+volatile word telFrame;
+volatile byte telBits;
+volatile bool telHalt;
+// Anzahl der verworfenen Zeichen, weil der Puffer voll war
+word telDropped;
+
+// Timer1 frei laufend als Bittakt, Pin auf Ruhepegel (high)
+void telBegin() {
+  periphClaim(P_TIMER1);
+  PORTA |= _BV(LED_PUMP_BIT);
+  DDRA |= _BV(LED_PUMP_BIT);
+  TCCR1A = 0;
+  TCCR1B = _BV(CS10);
+  telPrintP(PSTR("raw,lvl,in,pump,us,skip,ro,starts,rst,drop\r\n"));
+}
+
+// ein Zeichen in den Puffer, ist er voll wird das Zeichen verworfen, es wird nie gewartet
+void telWrite(byte b) {
+  byte next = (telHead + 1) & TEL_BUF_MASK;
+  if(next == telTail) {
+    telDropped++;
+    return;
+  }
+  telBuf[telHead] = b;
+  telHead = next;
+  if(!telHalt) {
+    telStart();
+  }
+}
+
+// Bittakt starten, falls er nicht schon läuft. Das erste Bit kommt eine Bitzeit später.
+void telStart() {
+  noInterrupts();
+  if(!(TIMSK1 & _BV(OCIE1A))) {
+    OCR1A = TCNT1 + TEL_BIT_TIME;
+    TIFR1 = _BV(OCF1A);
+    TIMSK1 |= _BV(OCIE1A);
+  }
+  interrupts();
+}
+
+void telPrint(const char* str) {
+  while(*str) {
+    telWrite(*str++);
+  }
+}
+
+// Text aus dem Flash (PSTR()), Literale belegen so kein SRAM
+void telPrintP(const char* str) {
+  char c;
+  while((c = pgm_read_byte(str++))) {
+    telWrite(c);
+  }
+}
+
+// Zeilenende
+void telEol() {
+  telWrite('\r');
+  telWrite('\n');
+}
+
+// Zahl dezimal ausgeben
+void telPrint(word value) {
+  char buf[6];
+  utoa(value, buf, 10);
+  telPrint(buf);
+}
+
+// Senden am Ende des aktuellen Zeichens anhalten (true) bzw. fortsetzen (false).
+// Beim Anhalten wird höchstens eine Zeichenlänge (~1ms) gewartet.
+void telHold(bool halt) {
+  telHalt = halt;
+  if(halt) {
+    while(TIMSK1 & _BV(OCIE1A));
+  } else if(telHead != telTail) {
+    telStart();
+  }
+}
+
+// eine CSV Zeile pro Loop: Rohwert, Füllstand in %, Eingänge als Bits, Relais, Loop Zeit in µs,
+// eingesparte Port Zugriffe, Nachlauf in Runden, Pumpenstarts, Warmstarts seit dem Kaltstart,
+// verworfene Zeichen (Puffer voll)
+void doTelemetry() {
+  byte in = tkFull | (flFull << 1) | (atMode << 2) | (mnPump << 3) | (lvlerr << 4) | (vccLow << 5) | ((dry.wait > 0) << 6) | (lvlHigh << 7);
+  telPrint(lvlRaw);
+  telWrite(',');
+  telPrint(word(tkLvl));
+  telWrite(',');
+  telPrint(word(in));
+  telWrite(',');
+  telWrite(relay ? '1' : '0');
+  telWrite(',');
+  telPrint(loopUs);
+  telWrite(',');
+  telPrint(outSkipped);
+  telWrite(',');
+  telPrint(runOn.laps);
+  telWrite(',');
+  telPrint(pumpStarts);
+  telWrite(',');
+  telPrint(warm.restarts);
+  telWrite(',');
+  telPrint(telDropped);
+  telEol();
+}
+
+// ein Bit pro Interrupt, LSB zuerst
+ISR(TIM1_COMPA_vect) {
+  OCR1A += TEL_BIT_TIME;
+  if(telBits == 0) {
+    if((telHead == telTail) || telHalt) {
+      // nichts mehr zu tun, Interrupt aus bis zum nächsten Zeichen
+      TIMSK1 &= ~_BV(OCIE1A);
+      return;
+    }
+    // Startbit (0), 8 Datenbits, Stopbit (1)
+    telFrame = (word(telBuf[telTail]) << 1) | 0x200;
+    telTail = (telTail + 1) & TEL_BUF_MASK;
+    telBits = 10;
+  }
+  if(telFrame & 1) {
+    PORTA |= _BV(LED_PUMP_BIT);
+  } else {
+    PORTA &= ~_BV(LED_PUMP_BIT);
+  }
+  telFrame >>= 1;
+  telBits--;
+}
+#endif
+
+#ifdef benchmark
+// Namen der Abschnitte für die Tabelle
+const char BN_REST[] PROGMEM = "rest";
+const char BN_INPUTS[] PROGMEM = "readAllInputs";
+const char BN_AVERAGE[] PROGMEM = "getAverage";
+const char BN_PUMP[] PROGMEM = "doPumpControl";
+const char BN_STRIP[] PROGMEM = "doStrip";
+const char* const BENCH_NAMES[B_COUNT] PROGMEM = {BN_REST, BN_INPUTS, BN_AVERAGE, BN_PUMP, BN_STRIP};
+
+// Messwerte je Abschnitt: letzter und größter Wert in Zyklen (bis 65535 = 8,2ms), Eigenbedarf einer Messung
+word benchLast[B_COUNT];
+word benchMax[B_COUNT];
+word benchOverhead;
+byte benchNext;
+
+// Eigenbedarf einer leeren Messung bestimmen
+void benchBegin() {
+  uint32_t start = cycles();
+  benchOverhead = word(cycles() - start);
+  if(BENCH_MEASURED) {
+    telPrintP(PSTR("bench,name,last,max,budget,result\r\n"));
+  } else {
+    telPrintP(PSTR("bench,name,last,max,budget_est,result\r\n"));
+  }
+}
+
+void benchAdd(byte id, uint32_t cycles) {
+  cycles = cycles > benchOverhead ? cycles - benchOverhead : 0;
+  word value = cycles > 0xFFFF ? 0xFFFF : word(cycles);
+  benchLast[id] = value;
+  if(value > benchMax[id]) {
+    benchMax[id] = value;
+  }
+}
+
+// eine Tabellenzeile pro Loop, reihum. FAIL wenn der größte Wert über dem Budget liegt,
+// mit ? solange das Budget nur geschätzt ist.
+void doBenchReport() {
+  word budget = pgm_read_word(&BENCH_BUDGET[benchNext]);
+  telPrintP(PSTR("bench,"));
+  telPrintP((const char*)pgm_read_word(&BENCH_NAMES[benchNext]));
+  telWrite(',');
+  telPrint(benchLast[benchNext]);
+  telWrite(',');
+  telPrint(benchMax[benchNext]);
+  telWrite(',');
+  telPrint(budget);
+  telPrintP(benchMax[benchNext] > budget ? PSTR(",FAIL") : PSTR(",OK"));
+  if(!BENCH_MEASURED) {
+    telWrite('?');
+  }
+  telEol();
+  benchNext = (benchNext + 1) % B_COUNT;
+}
+#endif
+
+#ifdef cyclecounter
+// Überläufe von Timer1, obere 16 Bit des Zyklenzählers
+volatile word t1Overflows;
+#ifdef instrument
+// größte Interrupt Latenz in Zyklen, gemessen am Überlauf Interrupt
+Snapshot<word> isrLatMax;
+#endif
+
+// Timer1 läuft schon frei (telBegin()), Überlauf Interrupt dazu
+void cyclesBegin() {
+  periphClaim(P_TIMER1);
+  TIFR1 = _BV(TOV1);
+  TIMSK1 |= _BV(TOIE1);
+}
+
+// 32 Bit Zyklenzähler aus TCNT1 und den Überläufen, ein noch nicht bearbeiteter Überlauf wird mitgezählt
+uint32_t cycles() {
+  byte sreg = SREG;
+  noInterrupts();
+  word lo = TCNT1;
+  word hi = t1Overflows;
+  if((TIFR1 & _BV(TOV1)) && (lo < 0x8000)) {
+    hi++;
+  }
+  SREG = sreg;
+  return (uint32_t(hi) << 16) | lo;
+}
+
+ISR(TIM1_OVF_vect) {
+#ifdef instrument
+  // der Überlauf war bei TCNT1 = 0, der Zählerstand ist also die Latenz (inkl. Prolog)
+  word lat = TCNT1;
+  if(lat > isrLatMax.peek()) {
+    isrLatMax.write(lat);
+  }
+#endif
+  t1Overflows++;
+}
+#endif
+
+#ifdef instrument
+void statAdd(uint32_t cycles) {
+  uint32_t us = cycles / clockCyclesPerMicrosecond();
+  word value = us > 0xFFFF ? 0xFFFF : word(us);
+  if(value < statMin) {
+    statMin = value;
+  }
+  if(value > statMax) {
+    statMax = value;
+  }
+  if(statAvg == 0) {
+    statAvg = value;
+  } else {
+    statAvg = statAvg - (statAvg >> 4) + (value >> 4);
+  }
+  // Bucket: 0,5ms und jede Verdopplung davon, der letzte nimmt den Rest
+  byte b = 0;
+  word limit = 500;
+  while((b < STAT_BUCKETS - 1) && (value >= limit)) {
+    limit <<= 1;
+    b++;
+  }
+  if(statHist[b] < 255) {
+    statHist[b]++;
+  }
+}
+
+// kleinster bisher freier Stack: unberührte Musterbytes ab dem Ende des Heaps
+word stackFree() {
+  const byte* start = __brkval ? (const byte*)__brkval : &__heap_start;
+  const byte* p = start;
+  while((p < (const byte*)SP) && (*p == STACK_CANARY)) {
+    p++;
+  }
+  return word(p - start);
+}
+
+// alle STAT_LAPS Runden statt der Telemetrie Zeile, in drei aufeinander folgenden Runden:
+// stat,min,max,avg (µs),latenz,sperre (Zyklen),freier Stack (Bytes)
+// hist,Histogramm der Loop Zeit
+// pwr Zeile (doPowerReport())
+bool doStatReport() {
+  statLaps++;
+  if(statLaps < STAT_LAPS) {
+    return false;
+  }
+  if(statLaps == STAT_LAPS) {
+    word lat = isrLatMax.read();
+    telPrintP(PSTR("stat,"));
+    telPrint(statMin);
+    telWrite(',');
+    telPrint(statMax);
+    telWrite(',');
+    telPrint(statAvg);
+    telWrite(',');
+    telPrint(lat);
+    telWrite(',');
+    telPrint(irqOffMax);
+    telWrite(',');
+    telPrint(stackFree());
+  } else if(statLaps == STAT_LAPS + 1) {
+    telPrintP(PSTR("hist"));
+    for(byte i = 0; i < STAT_BUCKETS; i++) {
+      telWrite(',');
+      telPrint(word(statHist[i]));
+    }
+  } else {
+    statLaps = 0;
+    doPowerReport();
+    return true;
+  }
+  telEol();
+  return true;
+}
+
+// pwr,adc,usi,t1 (Einschaltanteil in Promille),µA: geschätzte Ersparnis gegenüber
+// immer eingeschalteten Modulen nach PERIPH_UA
+void doPowerReport() {
+  uint32_t now = micros();
+  uint32_t span = now - pwrStart;
+  pwrStart = now;
+  uint32_t saved = 0;
+  telPrintP(PSTR("pwr"));
+  for(byte p = 0; p < P_COUNT; p++) {
+    uint32_t on = periphOnUs[p];
+    periphOnUs[p] = 0;
+    // ein gerade eingeschaltetes Modul zählt bis jetzt
+    if(periphRefs[p] > 0) {
+      on += now - periphSince[p];
+      periphSince[p] = now;
+    }
+    word permille = word(on / (span / 1000 + 1));
+    if(permille > 1000) {
+      permille = 1000;
+    }
+    saved += uint32_t(PERIPH_UA[p]) * (1000 - permille);
+    telWrite(',');
+    telPrint(permille);
+  }
+  telWrite(',');
+  telPrint(word(saved / 1000));
+  telEol();
+}
 #endif
-}
\ No newline at end of file
@@ -0,0 +1,125 @@
+/*
+   Host Tests für den Schutz gegen kurzes Takten (pumpfsm.h): pio test -e native
+
+   Automat und Startschutz laufen wie in doPumpControl(). Geprüft werden die Starts pro Stunde
+   und die Mindestpause nach einer Abschaltung über die Flanke Tank voll, dazu die Sperre nach
+   Unterspannung. Regenprofile über Stunden bis zu einer Saison laufen in test/test_sim.
+*/
+#include <unity.h>
+
+#include "pumpfsm.h"
+
+// Zeitbasis wie mit der Standardkonfiguration: 100ms pro Runde
+const uint32_t LAPS_PER_SEC = 10;
+const uint32_t HOUR_LAPS = 3600 * LAPS_PER_SEC;
+const uint16_t MIN_OFF_LAPS = 10 * LAPS_PER_SEC;
+const uint8_t MAX_STARTS = 30;
+const uint16_t SLOT_LAPS = START_SLOT_TIME * LAPS_PER_SEC;
+
+void setUp() {}
+void tearDown() {}
+
+// MAX_STARTS Starts am Stück: der nächste erst, wenn ihr Abschnitt aus dem Fenster fällt, also nach
+// START_SLOTS Abschnitten (mehr als eine Stunde)
+void test_hour_cap() {
+  StartGuard guard = {0xFFFF, 0, 0, 0, {0}};
+  for(uint8_t i = 0; i < MAX_STARTS; i++) {
+    startGuardSwitch(guard, true);
+    startGuardSwitch(guard, false);
+  }
+  uint32_t laps = 0;
+  while(startGuardStep(guard, false, MAX_STARTS, SLOT_LAPS, MIN_OFF_LAPS)) {
+    laps++;
+    TEST_ASSERT_LESS_OR_EQUAL(uint32_t(START_SLOTS) * SLOT_LAPS, laps);
+  }
+  TEST_ASSERT_EQUAL(uint32_t(START_SLOTS) * SLOT_LAPS - 1, laps);
+  TEST_ASSERT_GREATER_OR_EQUAL(HOUR_LAPS, laps);
+  TEST_ASSERT_EQUAL_UINT8(0, guard.count);
+}
+
+// Flanke Tank voll beim Pumpen (doEdge()), der Schwimmer prellt vor dem nächsten Takt zurück:
+// die Pumpe bleibt die Mindestpause lang aus und der Neustart kostet genau einen Start
+void test_tank_edge_then_float_clears() {
+  PumpFsm fsm = {PS_IDLE, 0};
+  StartGuard guard = {0xFFFF, 0, 0, 0, {0}};
+  bool relay = false;
+  // Takt wie doPumpControl(): Vorfilter voll, Tank nicht voll
+  for(uint8_t i = 0; i < 10; i++) {
+    uint8_t in = PI_AUTO | PI_FILTER | (startGuardStep(guard, relay, MAX_STARTS, SLOT_LAPS, MIN_OFF_LAPS) ? PI_HOLD : 0);
+    bool on = pumpFsmStep(fsm, in, 150);
+    if(on != relay) {
+      startGuardSwitch(guard, on);
+      relay = on;
+    }
+  }
+  TEST_ASSERT_TRUE(relay);
+  TEST_ASSERT_EQUAL_UINT8(1, guard.count);
+  // Flanke wie doEdge()
+  TEST_ASSERT_TRUE(pumpFsmTankEdge(fsm));
+  startGuardSwitch(guard, false);
+  relay = false;
+  TEST_ASSERT_EQUAL(PS_TANK_FULL, fsm.state);
+  // Schwimmer wieder frei, Vorfilter weiter voll
+  uint32_t laps = 0;
+  while(!relay) {
+    uint8_t in = PI_AUTO | PI_FILTER | (startGuardStep(guard, relay, MAX_STARTS, SLOT_LAPS, MIN_OFF_LAPS) ? PI_HOLD : 0);
+    bool on = pumpFsmStep(fsm, in, 150);
+    laps++;
+    if(on != relay) {
+      startGuardSwitch(guard, on);
+      relay = on;
+    }
+    TEST_ASSERT_LESS_OR_EQUAL(MIN_OFF_LAPS + 1, laps);
+  }
+  TEST_ASSERT_GREATER_OR_EQUAL(MIN_OFF_LAPS, laps);
+  TEST_ASSERT_EQUAL_UINT8(2, guard.count);
+}
+
+// im Handbetrieb und bei stehender Pumpe ändert die Flanke nichts
+void test_tank_edge_ignored() {
+  PumpFsm fsm = {PS_MANUAL, 0};
+  TEST_ASSERT_FALSE(pumpFsmTankEdge(fsm));
+  TEST_ASSERT_EQUAL(PS_MANUAL, fsm.state);
+  fsm.state = PS_IDLE;
+  TEST_ASSERT_FALSE(pumpFsmTankEdge(fsm));
+  TEST_ASSERT_EQUAL(PS_IDLE, fsm.state);
+}
+
+// Unterspannung: Sperre verdoppelt sich bei jedem Einbruch, ein ruhiger Lauf setzt sie zurück
+uint32_t supplyHold(SupplyGuard& g) {
+  uint32_t laps = 1;
+  TEST_ASSERT_TRUE(supplyGuardStep(g, true, true, LAPS_PER_SEC));
+  while(supplyGuardStep(g, false, false, LAPS_PER_SEC)) {
+    laps++;
+  }
+  return laps;
+}
+
+void test_supply_backoff() {
+  SupplyGuard g = {0, 0, 0};
+  TEST_ASSERT_FALSE(supplyGuardStep(g, false, true, LAPS_PER_SEC));
+  // Einbruch bei stehender Pumpe: keine Sperre, kein Fehler gezählt
+  TEST_ASSERT_FALSE(supplyGuardStep(g, true, false, LAPS_PER_SEC));
+  TEST_ASSERT_EQUAL_UINT8(0, g.trips);
+  TEST_ASSERT_EQUAL(0, g.wait);
+  TEST_ASSERT_EQUAL(SUPPLY_BACKOFF * LAPS_PER_SEC + 1, supplyHold(g));
+  TEST_ASSERT_EQUAL(2 * SUPPLY_BACKOFF * LAPS_PER_SEC + 1, supplyHold(g));
+  for(uint8_t i = 2; i < SUPPLY_MAX_TRIPS + 2; i++) {
+    supplyHold(g);
+  }
+  TEST_ASSERT_EQUAL((SUPPLY_BACKOFF * LAPS_PER_SEC << SUPPLY_MAX_TRIPS) + 1, supplyHold(g));
+  for(uint32_t i = 0; i < SUPPLY_OK_TIME * LAPS_PER_SEC; i++) {
+    TEST_ASSERT_FALSE(supplyGuardStep(g, false, true, LAPS_PER_SEC));
+  }
+  TEST_ASSERT_EQUAL_UINT8(0, g.trips);
+  TEST_ASSERT_EQUAL(SUPPLY_BACKOFF * LAPS_PER_SEC + 1, supplyHold(g));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_hour_cap);
+  RUN_TEST(test_tank_edge_then_float_clears);
+  RUN_TEST(test_tank_edge_ignored);
+  RUN_TEST(test_supply_backoff);
+  return UNITY_END();
+}
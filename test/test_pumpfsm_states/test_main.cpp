@@ -0,0 +1,119 @@
+/*
+   Host Tests für den Zustandsautomaten der Pumpe (pumpfsm.h): pio test -e native
+
+   Jeder Zustand wird mit jeder Kombination der Eingänge geschaltet. Im Automatikbetrieb
+   darf die Pumpe bei vollem Tank oder Fehler nie laufen, im Handbetrieb folgt sie dem Taster.
+   Dazu die Länge des Nachlaufs.
+*/
+#include <stdio.h>
+#include <unity.h>
+
+#include "pumpfsm.h"
+
+// alle Eingangsbits, die von außen kommen (PI_EXPIRED setzt der Schritt selbst, wird aber mit geprüft)
+const uint16_t INPUT_COMBINATIONS = 0x80;
+// Nachlaufzähler vor dem Schritt: abgelaufen, fast abgelaufen, läuft
+const uint16_t COUNTERS[] = {0, 1, 100};
+const uint16_t RUN_ON_LAPS = 150;
+
+char msg[64];
+
+const char* describe(uint8_t state, uint16_t counter, uint8_t in) {
+  snprintf(msg, sizeof(msg), "Zustand %u, Zähler %u, Eingänge 0x%02X", state, counter, in);
+  return msg;
+}
+
+void setUp() {}
+void tearDown() {}
+
+// Zustand x Zähler x Eingänge: gültiger Folgezustand, keine Pumpe bei Tank voll oder Fehler im Automatikbetrieb
+void test_all_states_all_inputs() {
+  for(uint8_t state = 0; state < PS_COUNT; state++) {
+    for(uint8_t c = 0; c < sizeof(COUNTERS) / sizeof(COUNTERS[0]); c++) {
+      for(uint16_t in = 0; in < INPUT_COMBINATIONS; in++) {
+        PumpFsm fsm = {state, COUNTERS[c]};
+        bool on = pumpFsmStep(fsm, uint8_t(in), RUN_ON_LAPS);
+        const char* m = describe(state, COUNTERS[c], uint8_t(in));
+        TEST_ASSERT_TRUE_MESSAGE(fsm.state < PS_COUNT, m);
+        if(in & PI_AUTO) {
+          TEST_ASSERT_TRUE_MESSAGE(fsm.state != PS_MANUAL, m);
+          if(in & (PI_TANK | PI_FAULT)) {
+            TEST_ASSERT_FALSE_MESSAGE(on, m);
+          }
+          // Fehler: sofort FAULT, vom Handbetrieb aus geht es erst über IDLE
+          if((in & PI_FAULT) && (state != PS_MANUAL)) {
+            TEST_ASSERT_EQUAL_MESSAGE(PS_FAULT, fsm.state, m);
+          }
+          // Startsperre: aus dem Leerlauf startet die Pumpe nicht
+          if((state == PS_IDLE) && (in & PI_HOLD)) {
+            TEST_ASSERT_FALSE_MESSAGE(on, m);
+          }
+        } else {
+          // Handbetrieb: Pumpe genau solange der Taster gedrückt ist
+          TEST_ASSERT_EQUAL_MESSAGE(PS_MANUAL, fsm.state, m);
+          TEST_ASSERT_EQUAL_MESSAGE((in & PI_BUTTON) != 0, on, m);
+        }
+        // Nachlaufzähler nur in FILLING und RUN_ON, in FILLING immer voll geladen
+        if(fsm.state == PS_FILLING) {
+          TEST_ASSERT_EQUAL_MESSAGE(RUN_ON_LAPS, fsm.counter, m);
+        } else if(fsm.state != PS_RUN_ON) {
+          TEST_ASSERT_EQUAL_MESSAGE(0, fsm.counter, m);
+        }
+      }
+    }
+  }
+}
+
+// Runden mit laufender Pumpe, nachdem der Vorfilter leer ist
+uint32_t runOnLength(uint16_t runOnLaps) {
+  PumpFsm fsm = {PS_IDLE, 0};
+  TEST_ASSERT_TRUE(pumpFsmStep(fsm, PI_AUTO | PI_FILTER, runOnLaps));
+  TEST_ASSERT_EQUAL(PS_FILLING, fsm.state);
+  uint32_t laps = 0;
+  while(pumpFsmStep(fsm, PI_AUTO, runOnLaps)) {
+    laps++;
+    TEST_ASSERT_LESS_OR_EQUAL(uint32_t(runOnLaps) + 1, laps);
+  }
+  TEST_ASSERT_EQUAL(PS_IDLE, fsm.state);
+  return laps;
+}
+
+// Nachlauf genau runOnLaps Runden, auch über 255 hinaus (adaptive Nachlaufzeit bis 4x)
+void test_run_on_length() {
+  const uint16_t laps[] = {1, 5, 150, 255, 256, 1020};
+  for(uint8_t i = 0; i < sizeof(laps) / sizeof(laps[0]); i++) {
+    TEST_ASSERT_EQUAL(laps[i], runOnLength(laps[i]));
+  }
+}
+
+// voller Vorfilter während des Nachlaufs lädt den Zähler neu
+void test_run_on_retrigger() {
+  PumpFsm fsm = {PS_IDLE, 0};
+  pumpFsmStep(fsm, PI_AUTO | PI_FILTER, RUN_ON_LAPS);
+  for(uint16_t i = 0; i < RUN_ON_LAPS / 2; i++) {
+    pumpFsmStep(fsm, PI_AUTO, RUN_ON_LAPS);
+  }
+  TEST_ASSERT_EQUAL(PS_RUN_ON, fsm.state);
+  pumpFsmStep(fsm, PI_AUTO | PI_FILTER, RUN_ON_LAPS);
+  TEST_ASSERT_EQUAL(PS_FILLING, fsm.state);
+  TEST_ASSERT_EQUAL(RUN_ON_LAPS, fsm.counter);
+}
+
+// Tank voll während des Nachlaufs: Pumpe sofort aus, danach zurück in den Leerlauf
+void test_tank_full_stops_run_on() {
+  PumpFsm fsm = {PS_RUN_ON, 100};
+  TEST_ASSERT_FALSE(pumpFsmStep(fsm, PI_AUTO | PI_TANK, RUN_ON_LAPS));
+  TEST_ASSERT_EQUAL(PS_TANK_FULL, fsm.state);
+  TEST_ASSERT_FALSE(pumpFsmStep(fsm, PI_AUTO | PI_FILTER, RUN_ON_LAPS));
+  TEST_ASSERT_EQUAL(PS_IDLE, fsm.state);
+  TEST_ASSERT_TRUE(pumpFsmStep(fsm, PI_AUTO | PI_FILTER, RUN_ON_LAPS));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_all_states_all_inputs);
+  RUN_TEST(test_run_on_length);
+  RUN_TEST(test_run_on_retrigger);
+  RUN_TEST(test_tank_full_stops_run_on);
+  return UNITY_END();
+}
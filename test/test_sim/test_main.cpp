@@ -0,0 +1,397 @@
+/*
+   Tank/Regen Simulation auf dem Host: pio test -e native -f test_sim -v
+
+   Ein einfaches Modell der Anlage (Dach -> Vorfilter -> Pumpe -> Tank -> Verbrauch) wird Runde für
+   Runde mit der Logik aus pumpfsm.h gesteuert: Zustandsautomat, Startschutz, adaptive Nachlaufzeit
+   und Trockenlaufschutz, verschaltet wie in doTick() / doPumpControl() (ohne Versorgungsspannung).
+   Pro Szenario wird eine Zeile ausgegeben: Schaltspiele des Relais, größte Anzahl Starts in einer
+   Stunde, Laufzeit und Energie der Pumpe, Überlauf des Vorfilters (mit Platz im Tank bzw. bei
+   vollem Tank), Trockenlaufzeit und Trockenlauffehler. Geprüft werden in jedem Szenario die
+   Mindestpause zwischen Stopp und nächstem Start und die Starts pro Stunde.
+
+   Das Modell ist grob: Zulauf proportional zur Regenmenge, Pumpe mit fester Förderleistung und
+   Leistungsaufnahme, Schwimmer mit fester Hysterese, Drucksensor mit gleichverteiltem Rauschen,
+   Messung in jeder Runde (ohne die adaptive Abtastung). Der Schwimmer des Vorfilters kann statt
+   vom Modell auch direkt von einem Profil gesteuert werden (Wellengang, hängender Schwimmer).
+   main.cpp selbst (Flanken, Abtastung, Versorgungsspannung) läuft hier nicht mit.
+*/
+#include <stdio.h>
+#include <unity.h>
+
+#include "pumpfsm.h"
+
+// Zeitbasis und Konfiguration wie mit den Standardwerten
+const uint32_t LAPS_PER_SEC = 10;
+const uint32_t MINUTE = 60 * LAPS_PER_SEC;
+const uint32_t HOUR = 60 * MINUTE;
+const uint32_t DAY = 24 * HOUR;
+const uint8_t RUN_ON_BASE = 15 * LAPS_PER_SEC;
+const uint16_t MIN_OFF_LAPS = 10 * LAPS_PER_SEC;
+const uint8_t MAX_STARTS = 30;
+const uint16_t SLOT_LAPS = START_SLOT_TIME * LAPS_PER_SEC;
+const uint8_t STOP_LVL = 95;
+const uint8_t STOP_HYST = 5;
+const uint16_t MIN_LVL = 220;
+const uint16_t MAX_LVL = 942;
+
+// Anlage, Mengen in µl
+const uint32_t ROOF_M2 = 50;
+const uint32_t FILTER_CAP = 30000000;     // Vorfilter 30 l, darüber läuft er über
+const uint32_t FILTER_ON = 20000000;      // Schwimmer Vorfilter voll ab 20 l
+const uint32_t FILTER_OFF = 18000000;     // und wieder leer unter 18 l
+const uint32_t PUMP_RATE = 100000;        // 1 l/s
+const uint32_t PUMP_WATT = 400;           // Leistungsaufnahme der Pumpe
+const uint64_t TANK_CAP = 5000000000ULL;  // Tank (Zisterne) 5000 l
+const uint8_t TANK_FLOAT = 98;            // Schwimmer Tank voll in %
+const uint16_t SENSOR_NOISE = 4;          // Rauschen des Drucksensors, ± A/D Schritte
+
+// Regenprofil: Regenmenge in mm/h in dieser Runde
+typedef uint16_t (*RainProfile)(uint32_t lap);
+// Schwimmerprofil: Vorfilter voll in dieser Runde, ersetzt den Schwimmer des Modells
+typedef bool (*FloatProfile)(uint32_t lap);
+
+struct Scenario {
+  const char* name;
+  RainProfile rain;
+  FloatProfile filterFloat;  // 0 = Schwimmer aus dem Modell
+  uint32_t laps;
+  uint8_t tankStart;   // Füllstand zu Beginn in %
+  uint8_t runOnBase;   // Nachlaufzeit in Runden
+  bool adapt;          // adaptive Nachlaufzeit an
+  uint16_t useLiters;  // Verbrauch pro Tag in l (Gießen ab 19 Uhr, 5 l/min)
+};
+
+struct Result {
+  uint16_t cycles;       // Schaltspiele (Starts) des Relais
+  uint16_t maxPerHour;   // größte Anzahl Starts in einer Stunde (gleitend)
+  uint16_t shortOff;     // Starts vor Ablauf der Mindestpause
+  uint32_t onLaps;       // Runden mit laufender Pumpe
+  uint32_t dryLaps;      // Runden, in denen die Pumpe nichts gefördert hat
+  uint16_t dryTrips;     // ausgelöste Trockenlaufsperren
+  uint16_t overflows;    // Überläufe des Vorfilters mit Platz im Tank
+  uint32_t lostRoomMl;   // dabei verlorenes Wasser in ml
+  uint32_t lostFullMl;   // übergelaufen bei vollem Tank (gewollt) in ml
+  uint32_t tankLostMl;   // Tank übergelaufen in ml
+  uint32_t usedL;        // verbrauchtes Wasser in l
+  uint32_t energyWh;     // Energie der Pumpe in Wh
+  bool onWhileTankFull;  // Pumpe lief bei Schwimmer Tank voll
+  uint8_t tankEnd;       // Füllstand am Ende in %
+};
+
+// Starts der letzten Stunde als Ringpuffer, für die gleitende Zählung
+const uint8_t WINDOW = 64;
+uint32_t window[WINDOW];
+
+// Regen aus mm/h in µl pro Runde: 1 mm auf 1 m² = 1 l
+uint32_t inflow(uint16_t mmh) { return uint32_t(mmh) * ROOF_M2 * 1000000UL / (3600 * LAPS_PER_SEC); }
+
+uint8_t percent(uint64_t tank) { return uint8_t(tank * 100 / TANK_CAP); }
+
+// reproduzierbarer Zufall (xorshift32)
+uint32_t rnd = 1;
+uint32_t nextRandom() {
+  rnd ^= rnd << 13;
+  rnd ^= rnd >> 17;
+  rnd ^= rnd << 5;
+  return rnd;
+}
+
+Result simulate(const Scenario& sc) {
+  Result r = {};
+  rnd = 1;
+  // Anlage
+  uint32_t filter = 0;
+  uint64_t tank = TANK_CAP * sc.tankStart / 100;
+  bool filterFloat = false;
+  bool overflowing = false;
+  // Steuerung
+  PumpFsm fsm = {PS_IDLE, 0};
+  StartGuard guard = {0xFFFF, 0, 0, 0, {0}};
+  RunOnAdapt runOn = {sc.runOnBase, 0xFFFF, 0};
+  DryRun dry = {};
+  bool relay = false;
+  bool lvlHigh = false;
+  uint16_t lvlEma = 0;
+  uint64_t lostRoom = 0, lostFull = 0, tankLost = 0, used = 0;
+  uint32_t lastStop = 0;
+  bool stopped = false;
+  uint8_t winHead = 0, winCount = 0;
+
+  for(uint32_t lap = 0; lap < sc.laps; lap++) {
+    // Regen in den Vorfilter, was nicht passt läuft über
+    filter += inflow(sc.rain(lap));
+    bool spill = filter > FILTER_CAP;
+    if(spill) {
+      if(lvlHigh || (percent(tank) >= TANK_FLOAT)) {
+        lostFull += filter - FILTER_CAP;
+      } else {
+        lostRoom += filter - FILTER_CAP;
+        if(!overflowing) {
+          r.overflows++;
+        }
+      }
+      filter = FILTER_CAP;
+    }
+    overflowing = spill;
+
+    // Verbrauch: ab 19 Uhr mit 5 l/min, solange Wasser da ist
+    uint32_t useLaps = uint32_t(sc.useLiters) * MINUTE / 5;
+    uint32_t t = lap % DAY;
+    if((t >= 19 * HOUR) && (t < 19 * HOUR + useLaps)) {
+      uint64_t take = 5000000ULL / MINUTE;
+      take = take > tank ? tank : take;
+      tank -= take;
+      used += take;
+    }
+
+    // Sensoren wie readAllInputs() / getTankLevel(), der Drucksensor rauscht
+    if(filter >= FILTER_ON) {
+      filterFloat = true;
+    } else if(filter < FILTER_OFF) {
+      filterFloat = false;
+    }
+    bool flFull = sc.filterFloat ? sc.filterFloat(lap) : filterFloat;
+    bool tkFull = percent(tank) >= TANK_FLOAT;
+    int32_t raw = MIN_LVL + int32_t(tank * (MAX_LVL - MIN_LVL) / TANK_CAP) + int32_t(nextRandom() % (2 * SENSOR_NOISE + 1)) - SENSOR_NOISE;
+    raw = raw < 0 ? 0 : (raw > 1023 ? 1023 : raw);
+    uint8_t lvl = raw <= MIN_LVL ? 0 : (raw >= MAX_LVL ? 100 : uint8_t((raw - MIN_LVL) * 100 / (MAX_LVL - MIN_LVL)));
+    if(lvlEma == 0) {
+      lvlEma = uint16_t(raw << 4);
+    } else {
+      lvlEma += int16_t((raw << 4) - lvlEma) >> 3;
+    }
+    if(lvl >= STOP_LVL) {
+      lvlHigh = true;
+    } else if(lvl < STOP_LVL - STOP_HYST) {
+      lvlHigh = false;
+    }
+
+    // doDryRunCheck()
+    uint16_t waitBefore = dry.wait;
+    dryRunStep(dry, relay && ((fsm.state == PS_FILLING) || (fsm.state == PS_RUN_ON)), lvlEma, LAPS_PER_SEC);
+    if((waitBefore == 0) && (dry.wait > 0)) {
+      r.dryTrips++;
+    }
+
+    // doPumpControl(), Automatikbetrieb
+    uint8_t in = PI_AUTO | (flFull ? PI_FILTER : 0) | ((tkFull || lvlHigh) ? PI_TANK : 0) | (dry.wait ? PI_FAULT : 0);
+    if(startGuardStep(guard, relay, MAX_STARTS, SLOT_LAPS, MIN_OFF_LAPS)) {
+      in |= PI_HOLD;
+    }
+    uint8_t prev = fsm.state;
+    bool on = pumpFsmStep(fsm, in, runOn.laps);
+    if(sc.adapt) {
+      runOnAdaptStep(runOn, prev, fsm.state, sc.runOnBase);
+    }
+    if(on != relay) {
+      startGuardSwitch(guard, on);
+      relay = on;
+      if(on) {
+        r.cycles++;
+        if(stopped && (lap - lastStop < MIN_OFF_LAPS)) {
+          r.shortOff++;
+        }
+        // Starts, die älter als eine Stunde sind, fallen aus dem Fenster
+        while((winCount > 0) && (window[uint8_t(winHead - winCount) % WINDOW] + HOUR <= lap)) {
+          winCount--;
+        }
+        window[winHead] = lap;
+        winHead = (winHead + 1) % WINDOW;
+        if(winCount < WINDOW) {
+          winCount++;
+        }
+        if(winCount > r.maxPerHour) {
+          r.maxPerHour = winCount;
+        }
+      } else {
+        lastStop = lap;
+        stopped = true;
+      }
+    }
+    if(relay && tkFull) {
+      r.onWhileTankFull = true;
+    }
+
+    // Pumpe fördert aus dem Vorfilter in den Tank
+    if(relay) {
+      r.onLaps++;
+      uint32_t moved = filter < PUMP_RATE ? filter : PUMP_RATE;
+      if(moved == 0) {
+        r.dryLaps++;
+      }
+      filter -= moved;
+      tank += moved;
+      if(tank > TANK_CAP) {
+        tankLost += tank - TANK_CAP;
+        tank = TANK_CAP;
+      }
+    }
+  }
+
+  r.lostRoomMl = uint32_t(lostRoom / 1000);
+  r.lostFullMl = uint32_t(lostFull / 1000);
+  r.tankLostMl = uint32_t(tankLost / 1000);
+  r.usedL = uint32_t(used / 1000000);
+  r.energyWh = uint32_t(uint64_t(r.onLaps) * PUMP_WATT / (3600 * LAPS_PER_SEC));
+  r.tankEnd = percent(tank);
+
+  char line[240];
+  snprintf(line, sizeof(line),
+           "%s: Starts %u (max %u/h), Pumpe %lu s %lu Wh, Überlauf %u mal %lu l (Tank voll %lu l), trocken %lu s, Sperren %u, verbraucht %lu l, Tank %u%%",
+           sc.name, r.cycles, r.maxPerHour, (unsigned long)(r.onLaps / LAPS_PER_SEC), (unsigned long)r.energyWh, r.overflows,
+           (unsigned long)(r.lostRoomMl / 1000), (unsigned long)(r.lostFullMl / 1000), (unsigned long)(r.dryLaps / LAPS_PER_SEC), r.dryTrips,
+           (unsigned long)r.usedL, r.tankEnd);
+  TEST_MESSAGE(line);
+  return r;
+}
+
+// gilt für jedes Szenario: Tank läuft nie über, keine Pumpe bei vollem Tank,
+// Mindestpause eingehalten, höchstens MAX_STARTS Starts pro Stunde
+void checkCommon(const Result& r) {
+  TEST_ASSERT_FALSE(r.onWhileTankFull);
+  TEST_ASSERT_EQUAL(0, r.tankLostMl);
+  TEST_ASSERT_EQUAL(0, r.shortOff);
+  TEST_ASSERT_LESS_OR_EQUAL(MAX_STARTS, r.maxPerHour);
+}
+
+// Regenprofile
+uint16_t rainDrizzle(uint32_t) { return 2; }
+uint16_t rainShowers(uint32_t lap) { return (lap % (40 * MINUTE)) < 10 * MINUTE ? 20 : 0; }
+uint16_t rainHeavy(uint32_t) { return 30; }
+uint16_t rainStrong(uint32_t) { return 60; }
+uint16_t rainStorm(uint32_t lap) { return lap < 30 * MINUTE ? 80 : 0; }
+uint16_t rainNone(uint32_t) { return 0; }
+
+// Saison: an etwa jedem dritten Tag Regen, Beginn, Dauer und Stärke zufällig, aber für jeden Tag fest
+uint16_t rainSeason(uint32_t lap) {
+  uint32_t day = lap / DAY;
+  uint32_t h = (day + 1) * 2654435761UL;
+  h ^= h >> 15;
+  if((h % 3) != 0) {
+    return 0;
+  }
+  uint32_t start = ((h >> 4) % 20) * HOUR;
+  uint32_t len = (1 + (h >> 9) % 6) * HOUR;
+  uint16_t mmh = 1 + (h >> 13) % 25;
+  uint32_t t = lap % DAY;
+  return ((t >= start) && (t < start + len)) ? mmh : 0;
+}
+
+// Schwimmer Vorfilter
+bool floatFlutter(uint32_t lap) { return (lap % 50) == 0; }  // Wellengang: alle 5s kurz voll
+bool floatStuck(uint32_t) { return true; }                    // hängt auf voll
+
+void setUp() {}
+void tearDown() {}
+
+// Nieselregen: der Vorfilter füllt sich langsam, kein Wasser darf verloren gehen
+void test_drizzle() {
+  Scenario sc = {"Nieselregen 2mm/h 6h", rainDrizzle, 0, 6 * HOUR, 30, RUN_ON_BASE, true, 0};
+  Result r = simulate(sc);
+  checkCommon(r);
+  TEST_ASSERT_GREATER_THAN(0, r.cycles);
+  TEST_ASSERT_EQUAL(0, r.overflows);
+  TEST_ASSERT_EQUAL(0, r.dryTrips);
+}
+
+// Schauer: 10 Minuten 20mm/h alle 40 Minuten
+void test_showers() {
+  Scenario sc = {"Schauer 20mm/h 6h", rainShowers, 0, 6 * HOUR, 30, RUN_ON_BASE, true, 0};
+  Result r = simulate(sc);
+  checkCommon(r);
+  TEST_ASSERT_EQUAL(0, r.dryTrips);
+}
+
+// Starkregen über der Förderleistung: Überlauf ist unvermeidbar, die Pumpe muss aber durchlaufen
+void test_storm() {
+  Scenario sc = {"Unwetter 80mm/h 30min", rainStorm, 0, HOUR, 30, RUN_ON_BASE, true, 0};
+  Result r = simulate(sc);
+  checkCommon(r);
+  TEST_ASSERT_LESS_OR_EQUAL(2, r.cycles);
+  TEST_ASSERT_GREATER_OR_EQUAL(30 * MINUTE, r.onLaps);
+}
+
+// fast voller Tank: Pumpenstopp über den Pegel trotz Rauschen, der Rest läuft am Vorfilter über
+void test_tank_full() {
+  Scenario sc = {"Tank fast voll, Schauer", rainShowers, 0, 6 * HOUR, 85, RUN_ON_BASE, true, 0};
+  Result r = simulate(sc);
+  checkCommon(r);
+  TEST_ASSERT_LESS_OR_EQUAL(STOP_LVL, r.tankEnd);
+  TEST_ASSERT_GREATER_THAN(0, r.lostFullMl);
+}
+
+// adaptive Nachlaufzeit gegen feste: weniger Schaltspiele bei gleichem Zulauf
+void test_adaptive_run_on() {
+  Scenario fixed = {"Dauerregen 30mm/h, fester Nachlauf", rainHeavy, 0, 2 * HOUR, 10, RUN_ON_BASE, false, 0};
+  Scenario adapt = {"Dauerregen 30mm/h, adaptiver Nachlauf", rainHeavy, 0, 2 * HOUR, 10, RUN_ON_BASE, true, 0};
+  Result rf = simulate(fixed);
+  Result ra = simulate(adapt);
+  checkCommon(rf);
+  checkCommon(ra);
+  TEST_ASSERT_LESS_THAN(rf.cycles, ra.cycles);
+  TEST_ASSERT_LESS_OR_EQUAL(rf.lostRoomMl, ra.lostRoomMl);
+}
+
+// Schwimmer Vorfilter hängt ohne Regen: Trockenlaufschutz schaltet ab, Wartezeit verdoppelt sich
+void test_dry_run() {
+  Scenario sc = {"Schwimmer hängt, trocken", rainNone, floatStuck, 2 * HOUR, 30, RUN_ON_BASE, true, 0};
+  Result r = simulate(sc);
+  checkCommon(r);
+  TEST_ASSERT_GREATER_OR_EQUAL(2, r.dryTrips);
+  // 60s Laufen, dann 60s, 120s, 240s ... Pause: weniger als ein Viertel der Zeit trocken
+  TEST_ASSERT_LESS_THAN(sc.laps / 4, r.dryLaps);
+}
+
+// flatternder Schwimmer und kurzer Nachlauf: ohne Schutz ein Start alle 5s. Die Starts pro Stunde sind
+// die Grenze, nicht die Mindestpause. Das Fenster ist 70 Minuten lang, also mindestens 6/7 davon.
+void test_flutter_short_run_on() {
+  Scenario sc = {"Schwimmer flattert, Nachlauf 0,2s", rainNone, floatFlutter, 4 * HOUR, 30, 2, false, 0};
+  Result r = simulate(sc);
+  checkCommon(r);
+  TEST_ASSERT_GREATER_OR_EQUAL(MAX_STARTS * 4 * (START_SLOTS - 1) / START_SLOTS, r.cycles);
+}
+
+// Schwimmer dauerhaft voll bei Zulauf unter der Förderleistung: die Pumpe läuft durch
+void test_steady_runs_through() {
+  Scenario sc = {"Dauerregen 60mm/h, Schwimmer voll", rainStrong, floatStuck, HOUR, 10, RUN_ON_BASE, true, 0};
+  Result r = simulate(sc);
+  checkCommon(r);
+  TEST_ASSERT_EQUAL(1, r.cycles);
+  TEST_ASSERT_EQUAL(0, r.dryTrips);
+  TEST_ASSERT_EQUAL(sc.laps, r.onLaps);
+}
+
+// trocken: kein Start
+void test_no_rain_no_start() {
+  Scenario sc = {"trocken", rainNone, 0, 4 * HOUR, 30, RUN_ON_BASE, true, 0};
+  Result r = simulate(sc);
+  checkCommon(r);
+  TEST_ASSERT_EQUAL(0, r.cycles);
+}
+
+// eine Saison (April bis September) mit Verbrauch: Energie, Schaltspiele und Überläufe über ein halbes Jahr.
+// Bei mittlerem Dauerregen reichen die Starts pro Stunde nicht immer, dann läuft der Vorfilter über.
+void test_season() {
+  Scenario sc = {"Saison 183 Tage, 150 l/Tag", rainSeason, 0, 183 * DAY, 50, RUN_ON_BASE, true, 150};
+  Result r = simulate(sc);
+  checkCommon(r);
+  TEST_ASSERT_GREATER_THAN(0, r.cycles);
+  TEST_ASSERT_GREATER_THAN(0, r.energyWh);
+  TEST_ASSERT_GREATER_THAN(0, r.usedL);
+  TEST_ASSERT_EQUAL(0, r.dryTrips);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_drizzle);
+  RUN_TEST(test_showers);
+  RUN_TEST(test_storm);
+  RUN_TEST(test_tank_full);
+  RUN_TEST(test_adaptive_run_on);
+  RUN_TEST(test_dry_run);
+  RUN_TEST(test_flutter_short_run_on);
+  RUN_TEST(test_steady_runs_through);
+  RUN_TEST(test_no_rain_no_start);
+  RUN_TEST(test_season);
+  return UNITY_END();
+}